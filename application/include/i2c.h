@@ -4,8 +4,74 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "options.h"
+
+typedef void (*i2c_stream_handler)(const uint8_t *data, size_t size);
+
+enum i2c_operation
+{
+    I2C_OPERATION_READ,
+    I2C_OPERATION_WRITE,
+    I2C_OPERATION_WRITE_READ,
+    I2C_OPERATION_WRITE_WRITE,
+    I2C_OPERATION_POLL
+};
+
+// Reads go to data_2, single writes come from data_1
+struct i2c_transaction
+{
+    uint8_t operation;
+    uint8_t address;
+    bool success;
+    bool pec;
+    bool pec_error;
+    uint16_t timeout;
+    const uint8_t *data_1;
+    size_t size_1;
+    uint8_t *data_2;
+    size_t size_2;
+};
+
 void i2c_init(void);
 
+#if FEATURE_BUS_SPEED
+bool i2c_set_frequency(uint32_t frequency,
+                       uint32_t rise_time,
+                       uint32_t fall_time,
+                       uint32_t *achieved);
+
+bool i2c_set_address_frequency(uint8_t address,
+                               uint32_t frequency,
+                               uint32_t rise_time,
+                               uint32_t fall_time,
+                               uint32_t *achieved);
+#endif
+
+bool i2c_set_timeout(uint32_t timeout);
+
+#if FEATURE_SMBUS
+void i2c_set_pec(bool enabled);
+
+bool i2c_pec_error(void);
+#else
+// Without SMBus support no transfer is checked with a PEC
+static inline void i2c_set_pec(bool enabled)
+{
+    (void)enabled;
+}
+
+static inline bool i2c_pec_error(void)
+{
+    return false;
+}
+#endif
+
+bool i2c_recover(void);
+
+bool i2c_probe(uint8_t address, bool *present);
+
+bool i2c_poll(uint8_t address, uint32_t timeout);
+
 bool i2c_read(uint8_t address, uint8_t *data, size_t size);
 
 bool i2c_write(uint8_t address, const uint8_t *data, size_t size);
@@ -17,3 +83,26 @@ bool i2c_write_read(uint8_t address,
 bool i2c_write_write(uint8_t address,
                      const uint8_t *data_1, size_t size_1,
                      const uint8_t *data_2, size_t size_2);
+
+#if FEATURE_SMBUS
+// data_2 receives the count byte followed by the block it announced
+bool i2c_write_block_read(uint8_t address,
+                          const uint8_t *data_1, size_t size_1,
+                          uint8_t *data_2, size_t size_2);
+#endif
+
+bool i2c_read_stream(uint8_t address,
+                     uint8_t *buffer, size_t chunk_size,
+                     size_t size,
+                     i2c_stream_handler handler);
+
+bool i2c_write_read_stream(uint8_t address,
+                           const uint8_t *data_1, size_t size_1,
+                           uint8_t *buffer, size_t chunk_size,
+                           size_t size_2,
+                           i2c_stream_handler handler);
+
+// One transaction at a time, the bus is not used otherwise until completed
+void i2c_submit(struct i2c_transaction *transaction);
+
+struct i2c_transaction *i2c_complete(void);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_MACRO_ID 254
+
+bool macro_erase(void);
+
+bool macro_begin(uint8_t id);
+
+bool macro_append(uint8_t id, const char *line, size_t length);
+
+bool macro_end(uint8_t id);
+
+const uint8_t *macro_find(uint8_t id);
+
+const char *macro_next_line(uint8_t id, const uint8_t **record,
+                            size_t *length);
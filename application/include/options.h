@@ -0,0 +1,76 @@
+#pragma once
+
+/*
+ * Optional shell features, each one enabled by defining it to 1. The 16K
+ * of flash of the STM32F042F4 does not hold all of them at once, so only
+ * the defaults below are built unless others are chosen in
+ * cpp.defines of usb-i2c.qbs, e.g. "FEATURE_JOBS=1", and another is left
+ * out to make room. The commands of a disabled feature answer ERROR.
+ *
+ * Each feature lists the code it adds. libopencm3, the C library and the
+ * vector table take about 5.4K, so the application and FreeRTOS get about
+ * 10.9K, or 9.9K with macros. Without the features below they take 8.9K,
+ * so the macros property of usb-i2c.qbs leaves out the other defaults.
+ */
+
+// Transfers run on the bus while the next command is parsed, 870 bytes
+#ifndef FEATURE_PIPELINE
+#define FEATURE_PIPELINE 1
+#endif
+
+// BATCH, a list of transfers with one combined answer, 710 bytes
+#ifndef FEATURE_BATCH
+#define FEATURE_BATCH 0
+#endif
+
+// READ and WRITE_READ of more than 64 bytes streamed in chunks, 560 bytes
+#ifndef FEATURE_STREAM
+#define FEATURE_STREAM 1
+#endif
+
+// SAMPLE, WATCH and CANCEL, periodic reads run by the device, 1110 bytes
+#ifndef FEATURE_JOBS
+#define FEATURE_JOBS 0
+#endif
+
+// SCAN for the addresses present on the bus, 270 bytes
+#ifndef FEATURE_SCAN
+#define FEATURE_SCAN 1
+#endif
+
+// MACRO, MACRO_BEGIN and MACRO_ERASE, and the boot macro, 1340 bytes. Set
+// by the macros property of usb-i2c.qbs, which also reserves the flash page
+// they live in.
+#ifndef FEATURE_MACROS
+#define FEATURE_MACROS 0
+#endif
+
+// COMPRESS, run-length and delta encoding of read data, 700 bytes
+#ifndef FEATURE_COMPRESSION
+#define FEATURE_COMPRESSION 0
+#endif
+
+// Lookup tables for the hex codec, faster but 970 bytes larger
+#ifndef FEATURE_HEX_TABLES
+#define FEATURE_HEX_TABLES 0
+#endif
+
+// POLL, EEPROM and EEPROM_WRITE, 810 bytes
+#ifndef FEATURE_EEPROM
+#define FEATURE_EEPROM 0
+#endif
+
+// SPEED and PROFILE, 1290 bytes, without them the bus runs at 400 kHz
+#ifndef FEATURE_BUS_SPEED
+#define FEATURE_BUS_SPEED 0
+#endif
+
+// BUSRESET, also run when a transfer fails with SDA held low, 340 bytes
+#ifndef FEATURE_RECOVERY
+#define FEATURE_RECOVERY 1
+#endif
+
+// The _PEC transfers and the SMBus block commands, 750 bytes
+#ifndef FEATURE_SMBUS
+#define FEATURE_SMBUS 0
+#endif
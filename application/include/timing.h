@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Edge times in nanoseconds assumed when none are given
+#define DEFAULT_RISE_TIME 100
+#define DEFAULT_FALL_TIME 10
+
+// Highest SCL frequency that does not need the Fm+ pin drive
+#define MAX_FAST_MODE_FREQUENCY 400000
+
+bool timing_compute(uint32_t clock,
+                    uint32_t frequency,
+                    uint32_t rise_time,
+                    uint32_t fall_time,
+                    uint32_t *timing,
+                    uint32_t *achieved);
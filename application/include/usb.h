@@ -7,4 +7,6 @@ void usb_init(void);
 
 size_t usb_recv(uint8_t *data, size_t size);
 
+size_t usb_recv_timeout(uint8_t *data, size_t size, uint32_t timeout);
+
 size_t usb_send(const uint8_t *data, size_t size);
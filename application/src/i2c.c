@@ -3,22 +3,167 @@
 #include <libopencm3/stm32/f0/nvic.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/syscfg.h>
 #include <libopencm3/stm32/i2c.h>
 #include <libopencm3/stm32/dma.h>
 
 #include <FreeRTOS.h>
-#include <semphr.h>
+#include <task.h>
 
+#include "options.h"
 #include "clock.h"
+#include "timing.h"
 
-static SemaphoreHandle_t semaphore_handle;
+// The task waiting for the interrupts to end a transfer
+static TaskHandle_t waiting_task;
+
+#define MAX_NBYTES 255
+#define MAX_DMA_COUNT 65535
+
+static volatile size_t i2c_remaining;
+
+static volatile uint8_t dma_channel;
+static volatile uint32_t dma_address;
+static volatile size_t dma_remaining;
+static volatile bool dma_streaming;
+
+// The part of a submitted transaction that follows a repeated START
+static volatile uint8_t chain_address;
+static volatile bool chain_write;
+static const uint8_t *volatile chain_data;
+static volatile size_t chain_size = 0;
+
+// Whether the interrupt ends the transfer with a STOP, and if it did
+static volatile bool stop_in_isr = false;
+static volatile bool stop_sent;
+
+#if FEATURE_SMBUS
+
+static bool pec_enabled = false;
+static bool pec_failed = false;
+static volatile bool pec_transfer = false;
+
+static uint8_t *volatile block_data = NULL;
+static size_t block_limit;
+
+#else
+
+// Without SMBus support no transfer carries a PEC byte or a block count
+#define pec_enabled false
+#define pec_transfer false
+#define block_data NULL
+
+#endif
+
+// Has the next transfer append or check a PEC byte if it ends with a STOP
+static void i2c_arm_pec(bool stop)
+{
+#if FEATURE_SMBUS
+    pec_transfer = pec_enabled && stop;
+#else
+    (void)stop;
+#endif
+}
+
+static void i2c1_load_bytes(void)
+{
+    size_t bytes = 1;
+
+    // A block read stops after its count byte until the rest is sized
+    if (!block_data) {
+        bytes = (i2c_remaining < MAX_NBYTES) ? i2c_remaining : MAX_NBYTES;
+        i2c_remaining -= bytes;
+    }
+
+    uint32_t cr2 = I2C_CR2(I2C1) & ~(I2C_CR2_NBYTES_MASK | I2C_CR2_RELOAD |
+                                     I2C_CR2_PECBYTE);
+    cr2 |= bytes << I2C_CR2_NBYTES_SHIFT;
+
+    // The PEC byte is the last one counted in NBYTES
+    if ((i2c_remaining > 0) || block_data) {
+        cr2 |= I2C_CR2_RELOAD;
+    } else if (pec_transfer) {
+        cr2 |= I2C_CR2_PECBYTE;
+    }
+
+    I2C_CR2(I2C1) = cr2;
+}
+
+static void dma1_load_count(size_t limit)
+{
+    size_t count = (dma_remaining < limit) ? dma_remaining : limit;
+
+    dma_set_memory_address(DMA1, dma_channel, dma_address);
+    dma_set_number_of_data(DMA1, dma_channel, (uint16_t)count);
+
+    dma_address += count;
+    dma_remaining -= count;
+}
+
+#if FEATURE_SMBUS
+
+// Continues a block read with as many bytes as its count byte announced
+static bool i2c1_load_block(void)
+{
+    uint8_t *data = block_data;
+    uint8_t count = (uint8_t)I2C_RXDR(I2C1);
+
+    block_data = NULL;
+    data[0] = count;
+
+    if ((count == 0) || (count > block_limit)) {
+        return false;
+    }
+
+    dma_disable_channel(DMA1, dma_channel);
+
+    dma_address = (uint32_t)&data[1];
+    dma_remaining = count;
+    dma1_load_count(MAX_DMA_COUNT);
+
+    dma_enable_channel(DMA1, dma_channel);
+
+    i2c_remaining = pec_transfer ? count + 1 : count;
+    i2c1_load_bytes();
+
+    return true;
+}
+
+#endif
+
+static uint8_t i2c_dma_load(uint8_t address,
+                            bool write,
+                            volatile const uint8_t *data,
+                            size_t size,
+                            size_t limit);
+
+// Starts the second part of a transaction right after the first one, so
+// that SCL is not held low until the task gets to it
+static void i2c1_chain(void)
+{
+    size_t size = chain_size;
+
+    chain_size = 0;
+
+    dma_disable_channel(DMA1, dma_channel);
+    dma_clear_interrupt_flags(DMA1, dma_channel, DMA_IFCR_CGIF_BIT);
+
+    i2c_arm_pec(true);
+
+    i2c_dma_load(chain_address, chain_write, chain_data, size, MAX_DMA_COUNT);
+
+    // The DMA interrupt was masked at the end of the first part
+    nvic_clear_pending_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+    nvic_enable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+}
+
+#define I2C_ISR_ERRORS (I2C_ISR_ARLO | I2C_ISR_BERR | I2C_ISR_OVR | \
+                        I2C_ISR_PECERR | I2C_ISR_TIMEOUT | I2C_ISR_ALERT | \
+                        I2C_ISR_NACKF)
 
 static inline bool i2c1_irq_active(void)
 {
-    static const uint32_t mask = I2C_ISR_ARLO | I2C_ISR_BERR | I2C_ISR_OVR |
-                                 I2C_ISR_PECERR | I2C_ISR_TIMEOUT |
-                                 I2C_ISR_ALERT | I2C_ISR_NACKF | I2C_ISR_TC;
-    return (I2C_ISR(I2C1) & mask) != 0;
+    return (I2C_ISR(I2C1) & (I2C_ISR_ERRORS | I2C_ISR_TC)) != 0;
 }
 
 void i2c1_isr(void)
@@ -28,20 +173,48 @@ void i2c1_isr(void)
         I2C_ICR(I2C1) |= I2C_ICR_BERRCF;
     }
 
-    if (!i2c1_irq_active()) {
+    bool block_failed = false;
+
+    // Continue a long transfer with the next NBYTES chunk
+    if ((I2C_ISR(I2C1) & I2C_ISR_TCR) != 0) {
+        if (block_data) {
+#if FEATURE_SMBUS
+            block_failed = !i2c1_load_block();
+#endif
+        } else {
+            i2c1_load_bytes();
+        }
+    }
+
+    if (!block_failed && !i2c1_irq_active()) {
+        return;
+    }
+
+    bool complete = i2c_transfer_complete(I2C1) &&
+                    ((I2C_ISR(I2C1) & I2C_ISR_ERRORS) == 0);
+
+    if (complete && (chain_size > 0)) {
+        i2c1_chain();
         return;
     }
 
     nvic_disable_irq(NVIC_I2C1_IRQ);
 
-    if (i2c_transfer_complete(I2C1)) {
+    // A submitted transaction gets its STOP here too, not from the task
+    if (complete && stop_in_isr) {
+        i2c_send_stop(I2C1);
+        stop_sent = true;
+    }
+
+    // Reads end with the DMA transfer, unless a PEC byte is still to come
+    if (complete && !pec_transfer) {
         if ((I2C_CR2(I2C1) & I2C_CR2_RD_WRN) != 0) {
             return;
         }
     }
 
-    BaseType_t need_yield;
-    xSemaphoreGiveFromISR(semaphore_handle, &need_yield);
+    BaseType_t need_yield = pdFALSE;
+    vTaskNotifyGiveFromISR(waiting_task, &need_yield);
     portYIELD_FROM_ISR(need_yield);
 }
 
@@ -57,22 +230,235 @@ void dma1_channel2_3_isr(void)
         return;
     }
 
+    // Continue a transfer longer than the DMA counter allows
+    if (!dma_streaming && (dma_remaining > 0) &&
+        dma_get_interrupt_flag(DMA1, dma_channel, DMA_ISR_TCIF_BIT) &&
+        !dma_get_interrupt_flag(DMA1, dma_channel, DMA_ISR_TEIF_BIT)) {
+        dma_disable_channel(DMA1, dma_channel);
+        dma_clear_interrupt_flags(DMA1, dma_channel, DMA_IFCR_CGIF_BIT);
+        dma1_load_count(MAX_DMA_COUNT);
+        dma_enable_channel(DMA1, dma_channel);
+        return;
+    }
+
     nvic_disable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
 
     if (dma_get_interrupt_flag(DMA1, DMA_CHANNEL2, DMA_ISR_TCIF_BIT)) {
         return;
     }
 
-    BaseType_t need_yield;
-    xSemaphoreGiveFromISR(semaphore_handle, &need_yield);
+    // The I2C interrupt signals the end once the PEC byte has been checked
+    if (pec_transfer && (dma_remaining == 0) &&
+        dma_get_interrupt_flag(DMA1, DMA_CHANNEL3, DMA_ISR_TCIF_BIT) &&
+        !dma_get_interrupt_flag(DMA1, DMA_CHANNEL3, DMA_ISR_TEIF_BIT)) {
+        return;
+    }
+
+    BaseType_t need_yield = pdFALSE;
+    vTaskNotifyGiveFromISR(waiting_task, &need_yield);
     portYIELD_FROM_ISR(need_yield);
 }
 
-void i2c_init(void)
+struct bus_timing
+{
+    uint32_t timing;
+    bool fast_mode_plus;
+};
+
+static struct bus_timing current_timing;
+
+static void i2c_set_timing(const struct bus_timing *timing)
+{
+    const uint16_t gpios = GPIO0 | GPIO1;
+
+    i2c_peripheral_disable(I2C1);
+
+    I2C_TIMINGR(I2C1) = timing->timing;
+
+    // Fm+ needs the stronger pin drive and fast edges
+    if (timing->fast_mode_plus) {
+        SYSCFG_CFGR1 |= SYSCFG_CFGR1_I2C1_FMP;
+        gpio_set_output_options(GPIOF, GPIO_OTYPE_OD, GPIO_OSPEED_HIGH, gpios);
+    } else {
+        SYSCFG_CFGR1 &= ~SYSCFG_CFGR1_I2C1_FMP;
+        gpio_set_output_options(GPIOF, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, gpios);
+    }
+
+    i2c_peripheral_enable(I2C1);
+
+    current_timing = *timing;
+}
+
+#if FEATURE_BUS_SPEED
+
+#define DEFAULT_FREQUENCY 400000
+
+#define MAX_SPEED_PROFILES 8
+
+struct speed_profile
+{
+    uint8_t address;
+    struct bus_timing timing;
+};
+
+static struct bus_timing default_timing;
+
+static struct speed_profile speed_profiles[MAX_SPEED_PROFILES];
+static size_t speed_profile_count = 0;
+
+// Reprograms the bus only when the device needs other timings than the last
+static void i2c_select_timing(uint8_t address)
+{
+    const struct bus_timing *timing = &default_timing;
+
+    for (size_t index = 0; index < speed_profile_count; index++) {
+        if (speed_profiles[index].address == address) {
+            timing = &speed_profiles[index].timing;
+            break;
+        }
+    }
+
+    if ((timing->timing != current_timing.timing) ||
+        (timing->fast_mode_plus != current_timing.fast_mode_plus)) {
+        i2c_set_timing(timing);
+    }
+}
+
+static bool i2c_compute_timing(uint32_t frequency,
+                               uint32_t rise_time,
+                               uint32_t fall_time,
+                               struct bus_timing *timing,
+                               uint32_t *achieved)
+{
+    if (!timing_compute(system_core_clock, frequency, rise_time, fall_time,
+                        &timing->timing, achieved)) {
+        return false;
+    }
+
+    timing->fast_mode_plus = (frequency > MAX_FAST_MODE_FREQUENCY);
+
+    return true;
+}
+
+// Only to be called while the bus is idle, as it resets the peripheral
+bool i2c_set_frequency(uint32_t frequency,
+                       uint32_t rise_time,
+                       uint32_t fall_time,
+                       uint32_t *achieved)
+{
+    if (!i2c_compute_timing(frequency, rise_time, fall_time,
+                            &default_timing, achieved)) {
+        return false;
+    }
+
+    i2c_set_timing(&default_timing);
+
+    return true;
+}
+
+// A zero frequency puts the device back on the default bus timings
+bool i2c_set_address_frequency(uint8_t address,
+                               uint32_t frequency,
+                               uint32_t rise_time,
+                               uint32_t fall_time,
+                               uint32_t *achieved)
+{
+    size_t index = 0;
+
+    while ((index < speed_profile_count) &&
+           (speed_profiles[index].address != address)) {
+        index++;
+    }
+
+    if (frequency == 0) {
+        if (index < speed_profile_count) {
+            speed_profile_count--;
+            speed_profiles[index] = speed_profiles[speed_profile_count];
+        }
+
+        *achieved = 0;
+
+        return true;
+    }
+
+    struct bus_timing timing;
+
+    if ((index == MAX_SPEED_PROFILES) ||
+        !i2c_compute_timing(frequency, rise_time, fall_time,
+                            &timing, achieved)) {
+        return false;
+    }
+
+    speed_profiles[index].address = address;
+    speed_profiles[index].timing = timing;
+
+    if (index == speed_profile_count) {
+        speed_profile_count++;
+    }
+
+    return true;
+}
+
+#else
+
+// RM0091 settings for 400 kHz with the 48 MHz clock set up by clock_setup()
+static const struct bus_timing default_timing = {0x50330309, false};
+
+static void i2c_select_timing(uint8_t address)
+{
+    (void)address;
+}
+
+#endif
+
+#define DEFAULT_BUS_TIMEOUT 25
+
+// TIMEOUTA counts in units of 2048 I2C clock cycles
+#define TIMEOUT_CYCLES 2048
+#define MAX_TIMEOUT_UNITS 0x1000
+
+static uint32_t bus_timeout;
+
+// Fails a transfer once SCL has been held low for timeout milliseconds
+bool i2c_set_timeout(uint32_t timeout)
+{
+    uint32_t units = (timeout * (system_core_clock / 1000) +
+                      TIMEOUT_CYCLES - 1) / TIMEOUT_CYCLES;
+
+    if ((units == 0) || (units > MAX_TIMEOUT_UNITS)) {
+        return false;
+    }
+
+    // TIMEOUTA can only be changed while the timeout is disabled
+    I2C_TIMEOUTR(I2C1) &= ~I2C_TIMEOUTR_TIMOUTEN;
+    I2C_TIMEOUTR(I2C1) = units - 1;
+    I2C_TIMEOUTR(I2C1) |= I2C_TIMEOUTR_TIMOUTEN;
+
+    bus_timeout = timeout;
+
+    return true;
+}
+
+#if FEATURE_SMBUS
+
+// Transfers ending with a STOP append or check a PEC byte while enabled
+void i2c_set_pec(bool enabled)
+{
+    pec_enabled = enabled;
+}
+
+// Whether the last failed transfer failed because the PEC did not match
+bool i2c_pec_error(void)
 {
-    static StaticSemaphore_t semaphore_data;
+    return pec_failed;
+}
 
+#endif
+
+void i2c_init(void)
+{
     rcc_periph_clock_enable(RCC_GPIOF);
+    rcc_periph_clock_enable(RCC_SYSCFG_COMP);
 
     const uint16_t gpios = GPIO0 | GPIO1;
     gpio_mode_setup(GPIOF, GPIO_MODE_AF, GPIO_PUPD_NONE, gpios);
@@ -83,66 +469,133 @@ void i2c_init(void)
 
     rcc_periph_clock_enable(RCC_I2C1);
 
-    i2c_set_speed(I2C1, i2c_speed_fm_400k, system_core_clock / 1000000);
+#if FEATURE_SMBUS
+    I2C_CR1(I2C1) |= I2C_CR1_PECEN;
+#endif
 
-    i2c_peripheral_enable(I2C1);
+#if FEATURE_BUS_SPEED
+    uint32_t achieved;
+    i2c_set_frequency(DEFAULT_FREQUENCY,
+                      DEFAULT_RISE_TIME, DEFAULT_FALL_TIME,
+                      &achieved);
+#else
+    i2c_set_timing(&default_timing);
+#endif
 
     rcc_periph_clock_enable(RCC_DMA1);
 
     i2c_enable_rxdma(I2C1);
     i2c_enable_txdma(I2C1);
 
-    dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL2);
-    dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL3);
+    // One store per channel instead of a library call per field, the byte
+    // sizes are zero
+    DMA_CPAR(DMA1, DMA_CHANNEL2) = (uint32_t)&I2C1_TXDR;
+    DMA_CPAR(DMA1, DMA_CHANNEL3) = (uint32_t)&I2C1_RXDR;
 
-    dma_set_read_from_memory(DMA1, DMA_CHANNEL2);
-    dma_set_read_from_peripheral(DMA1, DMA_CHANNEL3);
+    DMA_CCR(DMA1, DMA_CHANNEL2) = DMA_CCR_MINC | DMA_CCR_DIR |
+                                  DMA_CCR_TEIE | DMA_CCR_TCIE;
+    DMA_CCR(DMA1, DMA_CHANNEL3) = DMA_CCR_MINC |
+                                  DMA_CCR_TEIE | DMA_CCR_TCIE;
 
-    dma_set_memory_size(DMA1, DMA_CHANNEL2, DMA_CCR_MSIZE_8BIT);
-    dma_set_memory_size(DMA1, DMA_CHANNEL3, DMA_CCR_MSIZE_8BIT);
+    i2c_enable_interrupt(I2C1, I2C_CR1_ERRIE | I2C_CR1_NACKIE | I2C_CR1_TCIE);
 
-    dma_set_peripheral_size(DMA1, DMA_CHANNEL2, DMA_CCR_PSIZE_8BIT);
-    dma_set_peripheral_size(DMA1, DMA_CHANNEL3, DMA_CCR_PSIZE_8BIT);
+    i2c_set_timeout(DEFAULT_BUS_TIMEOUT);
+}
 
-    dma_set_peripheral_address(DMA1, DMA_CHANNEL2, (uint32_t)&I2C1_TXDR);
-    dma_set_peripheral_address(DMA1, DMA_CHANNEL3, (uint32_t)&I2C1_RXDR);
+static inline void i2c1_soft_reset(void)
+{
+    I2C_ICR(I2C1) |= I2C_ICR_TIMOUTCF;
 
-    semaphore_handle = xSemaphoreCreateBinaryStatic(&semaphore_data);
+    I2C_CR1(I2C1) &= ~I2C_CR1_PE;
 
-    dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL2);
-    dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL3);
+    while ((I2C_CR1(I2C1) & I2C_CR1_PE) != 0) {
+    }
 
-    dma_enable_transfer_error_interrupt(DMA1, DMA_CHANNEL2);
-    dma_enable_transfer_error_interrupt(DMA1, DMA_CHANNEL3);
+    I2C_CR1(I2C1) |= I2C_CR1_PE;
+}
 
-    nvic_enable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+#define SDA_GPIO GPIO0
+#define SCL_GPIO GPIO1
 
-    i2c_enable_interrupt(I2C1, I2C_CR1_ERRIE | I2C_CR1_NACKIE);
+#define RECOVERY_CLOCKS 9
 
-    nvic_enable_irq(NVIC_I2C1_IRQ);
+static bool i2c1_bus_free(void)
+{
+    return gpio_get(GPIOF, SDA_GPIO | SCL_GPIO) == (SDA_GPIO | SCL_GPIO);
 }
 
-static inline void i2c1_soft_reset(void)
+// At least half an SCL period at 100 kHz
+static void i2c_bus_delay(void)
 {
-    I2C_CR1(I2C1) &= ~I2C_CR1_PE;
+    for (volatile uint32_t cycle = 0;
+         cycle < system_core_clock / 1000000;
+         cycle++) {
+    }
+}
 
-    while ((I2C_CR1(I2C1) & I2C_CR1_PE) != 0) {
+// Clocks a target out of the byte it is still sending and ends with a STOP
+bool i2c_recover(void)
+{
+    i2c_peripheral_disable(I2C1);
+
+    gpio_set(GPIOF, SDA_GPIO | SCL_GPIO);
+    gpio_mode_setup(GPIOF, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE,
+                    SDA_GPIO | SCL_GPIO);
+
+    for (size_t clock = 0;
+         (clock < RECOVERY_CLOCKS) && !gpio_get(GPIOF, SDA_GPIO);
+         clock++) {
+        gpio_clear(GPIOF, SCL_GPIO);
+        i2c_bus_delay();
+        gpio_set(GPIOF, SCL_GPIO);
+        i2c_bus_delay();
     }
 
-    I2C_CR1(I2C1) |= I2C_CR1_PE;
+    gpio_clear(GPIOF, SCL_GPIO);
+    i2c_bus_delay();
+    gpio_clear(GPIOF, SDA_GPIO);
+    i2c_bus_delay();
+    gpio_set(GPIOF, SCL_GPIO);
+    i2c_bus_delay();
+    gpio_set(GPIOF, SDA_GPIO);
+    i2c_bus_delay();
+
+    bool free = i2c1_bus_free();
+
+    gpio_mode_setup(GPIOF, GPIO_MODE_AF, GPIO_PUPD_NONE, SDA_GPIO | SCL_GPIO);
+
+    i2c_peripheral_enable(I2C1);
+
+    return free;
 }
 
-static size_t i2c_dma_transfer(uint8_t address,
-                               bool write,
-                               volatile const uint8_t *data,
-                               size_t size,
-                               bool stop)
+// Toggling PE does not help when a target still holds SDA low
+static void i2c1_reset(void)
 {
-    uint8_t channel;
+    i2c1_soft_reset();
 
-    if (size == 0) {
-        return 0;
+#if FEATURE_RECOVERY
+    if (!i2c1_bus_free()) {
+        i2c_recover();
     }
+#endif
+}
+
+// Drops a notification left by an earlier transfer before starting one
+static void i2c_wait_prepare(void)
+{
+    waiting_task = xTaskGetCurrentTaskHandle();
+    ulTaskNotifyTake(pdTRUE, 0);
+}
+
+// Programs a transfer and sends its START, also from the interrupt
+static uint8_t i2c_dma_load(uint8_t address,
+                            bool write,
+                            volatile const uint8_t *data,
+                            size_t size,
+                            size_t limit)
+{
+    uint8_t channel;
 
     if (write) {
         channel = DMA_CHANNEL2;
@@ -155,24 +608,97 @@ static size_t i2c_dma_transfer(uint8_t address,
     i2c_set_7bit_addr_mode(I2C1);
     i2c_set_7bit_address(I2C1, address);
 
-    uint8_t bytes = (size < 255) ? (uint8_t)size : 255;
+#if FEATURE_SMBUS
+    pec_failed = false;
+#endif
 
-    i2c_set_bytes_to_transfer(I2C1, bytes);
-    dma_set_number_of_data(DMA1, channel, bytes);
+    stop_sent = false;
 
-    dma_set_memory_address(DMA1, channel, (uint32_t)data);
+    i2c_remaining = pec_transfer ? size + 1 : size;
+    i2c1_load_bytes();
 
-    xSemaphoreTake(semaphore_handle, 0);
+    dma_channel = channel;
+    dma_address = (uint32_t)data;
+    dma_remaining = size;
+    dma1_load_count(limit);
 
     dma_enable_channel(DMA1, channel);
 
     i2c_send_start(I2C1);
 
-    xSemaphoreTake(semaphore_handle, pdMS_TO_TICKS(1000));
+    return channel;
+}
+
+static uint8_t i2c_dma_start(uint8_t address,
+                             bool write,
+                             volatile const uint8_t *data,
+                             size_t size,
+                             size_t limit)
+{
+    i2c_select_timing(address);
+
+    i2c_wait_prepare();
+
+    uint8_t channel = i2c_dma_load(address, write, data, size, limit);
+
+    // Unmask only now, START clears the TC left by a transfer without STOP
+    nvic_clear_pending_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+    nvic_enable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+
+    nvic_clear_pending_irq(NVIC_I2C1_IRQ);
+    nvic_enable_irq(NVIC_I2C1_IRQ);
+
+    return channel;
+}
+
+// Microseconds per SCL period with the loaded timings, rounded up
+static uint32_t i2c_bit_time(void)
+{
+    uint32_t timing = current_timing.timing;
+    uint32_t presc = ((timing >> I2C_TIMINGR_PRESC_SHIFT) & 0xf) + 1;
+    uint32_t scll = ((timing >> I2C_TIMINGR_SCLL_SHIFT) & 0xff) + 1;
+    uint32_t sclh = ((timing >> I2C_TIMINGR_SCLH_SHIFT) & 0xff) + 1;
+    uint32_t cycles_per_us = system_core_clock / 1000000;
+
+    return (presc * (scll + sclh) + cycles_per_us - 1) / cycles_per_us;
+}
+
+static void i2c_dma_wait(size_t size)
+{
+    // The SCL low timeout ends stuck transfers, this is only a backstop
+    // for a bus that never gets free. Allow twice the time the bytes, the
+    // address and the acknowledges take at the current speed, which also
+    // covers synchronisation and slow edges.
+    uint32_t bits = ((uint32_t)size + 1) * 9;
+    uint32_t time = bits * i2c_bit_time() / 500 + 1;
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(bus_timeout + time));
+}
+
+static size_t i2c_dma_finish(uint8_t channel, size_t size, bool stop)
+{
+    size_t bytes = size;
 
     dma_disable_channel(DMA1, channel);
 
-    if (i2c_transfer_complete(I2C1)) {
+#if FEATURE_SMBUS
+    if (pec_transfer) {
+        // A received PEC byte is left behind in RXDR
+        (void)I2C_RXDR(I2C1);
+
+        if ((I2C_ISR(I2C1) & I2C_ISR_PECERR) != 0) {
+            I2C_ICR(I2C1) |= I2C_ICR_PECCF;
+            pec_failed = true;
+            bytes = 0;
+        }
+
+        pec_transfer = false;
+    }
+#endif
+
+    if (stop_sent) {
+        stop_sent = false;
+    } else if (i2c_transfer_complete(I2C1)) {
         if (stop) {
             i2c_send_stop(I2C1);
         }
@@ -180,26 +706,199 @@ static size_t i2c_dma_transfer(uint8_t address,
         if (i2c_nack(I2C1)) {
             I2C_ICR(I2C1) |= I2C_ICR_NACKCF | I2C_ICR_STOPCF;
         } else {
-            i2c1_soft_reset();
+            i2c1_reset();
         }
 
         bytes = 0;
     }
 
-    if (!dma_get_interrupt_flag(DMA1, channel, DMA_ISR_TCIF_BIT) ||
+    if ((dma_remaining > 0) ||
+        !dma_get_interrupt_flag(DMA1, channel, DMA_ISR_TCIF_BIT) ||
         dma_get_interrupt_flag(DMA1, channel, DMA_ISR_TEIF_BIT)) {
         bytes = 0;
     }
 
     dma_clear_interrupt_flags(DMA1, channel, DMA_IFCR_CGIF_BIT);
 
-    nvic_clear_pending_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
-    nvic_enable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+    nvic_disable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+    nvic_disable_irq(NVIC_I2C1_IRQ);
+
+    return bytes;
+}
+
+static size_t i2c_dma_transfer(uint8_t address,
+                               bool write,
+                               volatile const uint8_t *data,
+                               size_t size,
+                               bool stop)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    i2c_arm_pec(stop);
+
+    uint8_t channel = i2c_dma_start(address, write, data, size, MAX_DMA_COUNT);
+
+    i2c_dma_wait(size);
+
+    return i2c_dma_finish(channel, size, stop);
+}
+
+#if FEATURE_SMBUS
+
+/*
+ * Reads the count byte of an SMBus block into data[0] and then that many
+ * bytes after it, all within one transfer. The count byte is taken from
+ * RXDR by the interrupt, which then arms DMA for the rest of the block.
+ */
+static size_t i2c_dma_block(uint8_t address, uint8_t *data, size_t limit)
+{
+    pec_transfer = pec_enabled;
+
+    block_limit = limit;
+    block_data = data;
+
+    uint8_t channel = i2c_dma_start(address, false, &data[1], 0, 0);
+
+    i2c_dma_wait(limit + 1);
+
+    size_t bytes = i2c_dma_finish(channel, data[0], true);
+
+    block_data = NULL;
+
+    return bytes;
+}
+
+#endif
+
+/*
+ * Reads into the two halves of the buffer in turn and hands every filled
+ * half to the handler while DMA continues into the other one. If the
+ * handler falls behind, DMA stops and the target stretches SCL until the
+ * next half is armed, so the transfer never loses data or breaks up.
+ */
+static bool i2c_dma_stream(uint8_t address,
+                           uint8_t *buffer,
+                           size_t chunk_size,
+                           size_t size,
+                           i2c_stream_handler handler)
+{
+    if (size == 0) {
+        return true;
+    }
+
+    uint8_t *chunk = buffer;
+
+    dma_streaming = true;
+    i2c_arm_pec(true);
+
+    uint8_t channel = i2c_dma_start(address, false, chunk, size, chunk_size);
+
+    for (;;) {
+        i2c_dma_wait(chunk_size);
+
+        if ((dma_remaining == 0) ||
+            !dma_get_interrupt_flag(DMA1, channel, DMA_ISR_TCIF_BIT) ||
+            dma_get_interrupt_flag(DMA1, channel, DMA_ISR_TEIF_BIT) ||
+            i2c1_irq_active()) {
+            break;
+        }
+
+        const uint8_t *filled = chunk;
+        chunk = (chunk == buffer) ? &buffer[chunk_size] : buffer;
+
+        dma_disable_channel(DMA1, channel);
+        dma_clear_interrupt_flags(DMA1, channel, DMA_IFCR_CGIF_BIT);
+
+        dma_address = (uint32_t)chunk;
+        dma1_load_count(chunk_size);
+
+        dma_enable_channel(DMA1, channel);
+
+        nvic_clear_pending_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+        nvic_enable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
+
+        // SCL is held low on purpose while a slow handler keeps both halves
+        I2C_TIMEOUTR(I2C1) &= ~I2C_TIMEOUTR_TIMOUTEN;
+        handler(filled, chunk_size);
+        I2C_TIMEOUTR(I2C1) |= I2C_TIMEOUTR_TIMOUTEN;
+    }
+
+    dma_streaming = false;
+
+    size_t last_size = (size - 1) % chunk_size + 1;
+
+    if (i2c_dma_finish(channel, size, true) != size) {
+        return false;
+    }
+
+    handler(chunk, last_size);
+
+    return true;
+}
+
+#define PROBE_TIMEOUT 5
+
+bool i2c_probe(uint8_t address, bool *present)
+{
+    bool success = true;
+
+    i2c_select_timing(address);
+
+    i2c_set_write_transfer_dir(I2C1);
+
+    i2c_set_7bit_addr_mode(I2C1);
+    i2c_set_7bit_address(I2C1, address);
+
+    i2c_remaining = 0;
+    i2c1_load_bytes();
+
+    i2c_wait_prepare();
+
+    i2c_send_start(I2C1);
 
     nvic_clear_pending_irq(NVIC_I2C1_IRQ);
     nvic_enable_irq(NVIC_I2C1_IRQ);
 
-    return bytes;
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PROBE_TIMEOUT));
+
+    *present = i2c_transfer_complete(I2C1);
+
+    if (*present) {
+        i2c_send_stop(I2C1);
+    } else if (i2c_nack(I2C1)) {
+        I2C_ICR(I2C1) |= I2C_ICR_NACKCF | I2C_ICR_STOPCF;
+    } else {
+        i2c1_reset();
+        success = false;
+    }
+
+    nvic_disable_irq(NVIC_I2C1_IRQ);
+
+    return success;
+}
+
+// Waits for a device that NACKs while busy, e.g. an EEPROM write cycle
+bool i2c_poll(uint8_t address, uint32_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    for (;;) {
+        bool present;
+
+        if (!i2c_probe(address, &present)) {
+            return false;
+        }
+
+        if (present) {
+            return true;
+        }
+
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(timeout)) {
+            return false;
+        }
+    }
 }
 
 bool i2c_read(uint8_t address, uint8_t *data, size_t size)
@@ -249,3 +948,140 @@ bool i2c_write_write(uint8_t address,
 
     return true;
 }
+
+#if FEATURE_SMBUS
+
+// SMBus block read or block process call, depending on what is written
+bool i2c_write_block_read(uint8_t address,
+                          const uint8_t *data_1, size_t size_1,
+                          uint8_t *data_2, size_t size_2)
+{
+    if (i2c_dma_transfer(address, true, data_1, size_1, false) != size_1) {
+        return false;
+    }
+
+    if ((size_2 < 2) || (i2c_dma_block(address, data_2, size_2 - 1) == 0)) {
+        return false;
+    }
+
+    return true;
+}
+
+#endif
+
+bool i2c_read_stream(uint8_t address,
+                     uint8_t *buffer, size_t chunk_size,
+                     size_t size,
+                     i2c_stream_handler handler)
+{
+    return i2c_dma_stream(address, buffer, chunk_size, size, handler);
+}
+
+bool i2c_write_read_stream(uint8_t address,
+                           const uint8_t *data_1, size_t size_1,
+                           uint8_t *buffer, size_t chunk_size,
+                           size_t size_2,
+                           i2c_stream_handler handler)
+{
+    if (i2c_dma_transfer(address, true, data_1, size_1, false) != size_1) {
+        return false;
+    }
+
+    return i2c_dma_stream(address, buffer, chunk_size, size_2, handler);
+}
+
+// The transaction running while the shell goes on, the size of its first
+// part and whether a second part follows that with a repeated START
+static struct i2c_transaction *pending_transaction = NULL;
+static size_t pending_size;
+static bool pending_chained;
+
+/*
+ * Starts a transaction without waiting for it. The interrupt ending the
+ * first part starts the second one at once and the one ending the last
+ * part sends the STOP, so SCL is never held low until the task gets
+ * around to it.
+ */
+void i2c_submit(struct i2c_transaction *transaction)
+{
+    pending_transaction = transaction;
+    pending_size = 0;
+    pending_chained = false;
+
+    i2c_set_pec(transaction->pec);
+
+    bool write = (transaction->operation != I2C_OPERATION_READ);
+    const uint8_t *data = write ? transaction->data_1 : transaction->data_2;
+    size_t size = write ? transaction->size_1 : transaction->size_2;
+
+    // A POLL probes repeatedly, it runs in i2c_complete() as a whole
+    if ((transaction->operation == I2C_OPERATION_POLL) || (size == 0)) {
+        return;
+    }
+
+    pending_size = size;
+    pending_chained = (transaction->size_2 > 0) &&
+                      ((transaction->operation == I2C_OPERATION_WRITE_READ) ||
+                       (transaction->operation == I2C_OPERATION_WRITE_WRITE));
+
+    if (pending_chained) {
+        chain_address = transaction->address;
+        chain_write = (transaction->operation == I2C_OPERATION_WRITE_WRITE);
+        chain_data = transaction->data_2;
+        chain_size = transaction->size_2;
+    }
+
+    i2c_arm_pec(!pending_chained);
+
+    stop_in_isr = true;
+
+    i2c_dma_start(transaction->address, write, data, size, MAX_DMA_COUNT);
+}
+
+// Waits for the submitted transaction to end
+struct i2c_transaction *i2c_complete(void)
+{
+    struct i2c_transaction *transaction = pending_transaction;
+    bool success = true;
+
+    pending_transaction = NULL;
+
+    if (pending_size > 0) {
+        size_t size = pending_size;
+
+        if (pending_chained) {
+            i2c_dma_wait(pending_size + transaction->size_2);
+
+            // A first part that failed left the second one unstarted, and
+            // the interrupt must not start it behind the check
+            nvic_disable_irq(NVIC_I2C1_IRQ);
+
+            if (chain_size == 0) {
+                size = transaction->size_2;
+            } else {
+                chain_size = 0;
+                success = false;
+            }
+        } else {
+            i2c_dma_wait(pending_size);
+        }
+
+        success = (i2c_dma_finish(dma_channel, size, true) == size) &&
+                  success;
+
+        stop_in_isr = false;
+    }
+
+#if FEATURE_EEPROM
+    if (transaction->operation == I2C_OPERATION_POLL) {
+        success = i2c_poll(transaction->address, transaction->timeout);
+    }
+#endif
+
+    transaction->success = success;
+    transaction->pec_error = transaction->pec && !success && i2c_pec_error();
+
+    i2c_set_pec(false);
+
+    return transaction;
+}
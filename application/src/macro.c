@@ -0,0 +1,190 @@
+#include "macro.h"
+
+#include <string.h>
+
+#include <libopencm3/stm32/flash.h>
+
+/*
+ * Macros are kept as a log of records in a flash page reserved by the
+ * linker script. Each record is a half-word with its kind and macro ID,
+ * a half-word length and the padded body. The length is programmed first
+ * and the kind last, so an interrupted write is skipped as incomplete.
+ * A macro consists of the LINE records between the latest BEGIN and END
+ * records carrying its ID; older definitions are simply left behind.
+ */
+
+extern const uint8_t _macro_start[];
+extern const uint8_t _macro_end[];
+
+#define RECORD_HEADER_SIZE 4
+
+#define RECORD_ERASED 0xffff
+
+enum
+{
+    RECORD_BEGIN = 'B',
+    RECORD_LINE = 'L',
+    RECORD_END = 'E'
+};
+
+static inline uint16_t record_kind(const uint8_t *record)
+{
+    return *(const uint16_t *)record;
+}
+
+static inline uint16_t record_length(const uint8_t *record)
+{
+    return *(const uint16_t *)&record[2];
+}
+
+static inline bool record_is(const uint8_t *record, uint8_t kind, uint8_t id)
+{
+    return record_kind(record) == ((kind << 8) | id);
+}
+
+static const uint8_t *record_next(const uint8_t *record)
+{
+    if ((size_t)(_macro_end - record) < RECORD_HEADER_SIZE) {
+        return NULL;
+    }
+
+    if ((record_kind(record) == RECORD_ERASED) &&
+        (record_length(record) == RECORD_ERASED)) {
+        return NULL;
+    }
+
+    size_t size = RECORD_HEADER_SIZE + ((record_length(record) + 1) & ~1u);
+
+    if ((size_t)(_macro_end - record) < size) {
+        return NULL;
+    }
+
+    return record + size;
+}
+
+static const uint8_t *record_free(void)
+{
+    const uint8_t *record = _macro_start;
+
+    for (;;) {
+        const uint8_t *next = record_next(record);
+        if (!next) {
+            break;
+        }
+
+        record = next;
+    }
+
+    if ((size_t)(_macro_end - record) < RECORD_HEADER_SIZE) {
+        return NULL;
+    }
+
+    if ((record_kind(record) != RECORD_ERASED) ||
+        (record_length(record) != RECORD_ERASED)) {
+        return NULL;
+    }
+
+    return record;
+}
+
+static bool record_append(uint8_t kind,
+                          uint8_t id,
+                          const char *body,
+                          size_t length)
+{
+    const uint8_t *record = record_free();
+    size_t size = RECORD_HEADER_SIZE + ((length + 1) & ~1u);
+
+    if (!record || ((size_t)(_macro_end - record) < size)) {
+        return false;
+    }
+
+    uint32_t address = (uint32_t)record;
+
+    flash_unlock();
+
+    flash_program_half_word(address + 2, (uint16_t)length);
+
+    for (size_t position = 0; position < length; position += 2) {
+        uint16_t half_word = (uint8_t)body[position];
+
+        if (position + 1 < length) {
+            half_word |= (uint8_t)body[position + 1] << 8;
+        } else {
+            half_word |= 0xff00;
+        }
+
+        flash_program_half_word(address + RECORD_HEADER_SIZE + position,
+                                half_word);
+    }
+
+    flash_program_half_word(address, (uint16_t)((kind << 8) | id));
+
+    flash_lock();
+
+    return record_is(record, kind, id) &&
+           (record_length(record) == length) &&
+           ((length == 0) ||
+            (memcmp(&record[RECORD_HEADER_SIZE], body, length) == 0));
+}
+
+bool macro_erase(void)
+{
+    flash_unlock();
+    flash_erase_page((uint32_t)_macro_start);
+    flash_lock();
+
+    return record_free() == _macro_start;
+}
+
+bool macro_begin(uint8_t id)
+{
+    return record_append(RECORD_BEGIN, id, NULL, 0);
+}
+
+bool macro_append(uint8_t id, const char *line, size_t length)
+{
+    return record_append(RECORD_LINE, id, line, length);
+}
+
+bool macro_end(uint8_t id)
+{
+    return record_append(RECORD_END, id, NULL, 0);
+}
+
+// Finds the first record of the latest complete definition of a macro
+const uint8_t *macro_find(uint8_t id)
+{
+    const uint8_t *start = NULL;
+    const uint8_t *macro = NULL;
+
+    for (const uint8_t *record = _macro_start;
+         record;
+         record = record_next(record)) {
+        if (record_is(record, RECORD_BEGIN, id)) {
+            start = record_next(record);
+        } else if (record_is(record, RECORD_END, id) && start) {
+            macro = start;
+            start = NULL;
+        }
+    }
+
+    return macro;
+}
+
+// Returns the line at or after a record of the macro and moves past it
+const char *macro_next_line(uint8_t id, const uint8_t **record, size_t *length)
+{
+    for (const uint8_t *current = *record;
+         !record_is(current, RECORD_END, id);
+         current = record_next(current)) {
+        if (record_is(current, RECORD_LINE, id)) {
+            *record = record_next(current);
+            *length = record_length(current);
+
+            return (const char *)&current[RECORD_HEADER_SIZE];
+        }
+    }
+
+    return NULL;
+}
@@ -10,59 +10,179 @@
 #include <FreeRTOS.h>
 #include <task.h>
 
+#include "options.h"
 #include "usb.h"
 #include "i2c.h"
+#include "macro.h"
+#include "timing.h"
+
+#if FEATURE_HEX_TABLES
+
+#define HEX_DIGIT(value) ((value) < 10 ? '0' + (value) : 'a' + (value) - 10)
+#define HEX_PAIR(byte) (HEX_DIGIT((byte) >> 4) | HEX_DIGIT((byte) & 0x0f) << 8)
+#define HEX_ROW(high) \
+    HEX_PAIR(high + 0x0), HEX_PAIR(high + 0x1), HEX_PAIR(high + 0x2), \
+    HEX_PAIR(high + 0x3), HEX_PAIR(high + 0x4), HEX_PAIR(high + 0x5), \
+    HEX_PAIR(high + 0x6), HEX_PAIR(high + 0x7), HEX_PAIR(high + 0x8), \
+    HEX_PAIR(high + 0x9), HEX_PAIR(high + 0xa), HEX_PAIR(high + 0xb), \
+    HEX_PAIR(high + 0xc), HEX_PAIR(high + 0xd), HEX_PAIR(high + 0xe), \
+    HEX_PAIR(high + 0xf)
+
+// Both digits of every byte, the first one in the low byte
+static const uint16_t hex_digits[256] = {
+    HEX_ROW(0x00), HEX_ROW(0x10), HEX_ROW(0x20), HEX_ROW(0x30),
+    HEX_ROW(0x40), HEX_ROW(0x50), HEX_ROW(0x60), HEX_ROW(0x70),
+    HEX_ROW(0x80), HEX_ROW(0x90), HEX_ROW(0xa0), HEX_ROW(0xb0),
+    HEX_ROW(0xc0), HEX_ROW(0xd0), HEX_ROW(0xe0), HEX_ROW(0xf0)
+};
+
+#define HEX_VALID 0x10
+
+// Digit values marked with HEX_VALID, zero for other characters
+static const uint8_t hex_values[256] = {
+    ['0'] = HEX_VALID | 0x0, ['1'] = HEX_VALID | 0x1,
+    ['2'] = HEX_VALID | 0x2, ['3'] = HEX_VALID | 0x3,
+    ['4'] = HEX_VALID | 0x4, ['5'] = HEX_VALID | 0x5,
+    ['6'] = HEX_VALID | 0x6, ['7'] = HEX_VALID | 0x7,
+    ['8'] = HEX_VALID | 0x8, ['9'] = HEX_VALID | 0x9,
+    ['A'] = HEX_VALID | 0xa, ['B'] = HEX_VALID | 0xb,
+    ['C'] = HEX_VALID | 0xc, ['D'] = HEX_VALID | 0xd,
+    ['E'] = HEX_VALID | 0xe, ['F'] = HEX_VALID | 0xf,
+    ['a'] = HEX_VALID | 0xa, ['b'] = HEX_VALID | 0xb,
+    ['c'] = HEX_VALID | 0xc, ['d'] = HEX_VALID | 0xd,
+    ['e'] = HEX_VALID | 0xe, ['f'] = HEX_VALID | 0xf
+};
+
+typedef uint32_t __attribute__((may_alias)) hex_word;
 
 static bool write_hex(const uint8_t *data, char *string, size_t length)
 {
-    for (size_t position = 0; position < length; position++) {
-        uint8_t value = data[position];
+    size_t position = 0;
+
+    // Once the string is word aligned, store the digits of two bytes at once
+    if ((((uintptr_t)string & 1) == 0) && (length > 0)) {
+        if (((uintptr_t)string & 2) != 0) {
+            uint16_t digits = hex_digits[data[0]];
+            string[0] = (char)digits;
+            string[1] = (char)(digits >> 8);
+            position++;
+        }
+
+        for (; position + 2 <= length; position += 2) {
+            *(hex_word *)&string[position * 2] =
+                hex_digits[data[position]] |
+                ((uint32_t)hex_digits[data[position + 1]] << 16);
+        }
+    }
 
-        for (size_t place = 0; place < 2; place++) {
-            char digit = value & 0x0f;
+    for (; position < length; position++) {
+        uint16_t digits = hex_digits[data[position]];
+        string[position * 2] = (char)digits;
+        string[position * 2 + 1] = (char)(digits >> 8);
+    }
 
-            value >>= 4;
+    string[length * 2] = '\0';
 
-            if (digit <= 9) {
-                digit += '0';
-            } else {
-                digit += 'a' - 10;
-            }
+    return true;
+}
+
+static uint8_t read_hex_byte(const char *string, uint8_t *valid)
+{
+    uint8_t high = hex_values[(uint8_t)string[0]];
+    uint8_t low = hex_values[(uint8_t)string[1]];
+
+    *valid &= high & low;
+
+    return (uint8_t)((high << 4) | (low & 0x0f));
+}
+
+static bool read_hex(const char *string, uint8_t *data, size_t length)
+{
+    uint8_t valid = HEX_VALID;
+    size_t position = 0;
+
+    // Once the string is word aligned, load the digits of two bytes at once
+    if ((((uintptr_t)string & 1) == 0) && (length > 0)) {
+        if (((uintptr_t)string & 2) != 0) {
+            data[0] = read_hex_byte(string, &valid);
+            position++;
+        }
+
+        for (; position + 2 <= length; position += 2) {
+            uint32_t digits = *(const hex_word *)&string[position * 2];
+            uint8_t high_1 = hex_values[(uint8_t)digits];
+            uint8_t low_1 = hex_values[(uint8_t)(digits >> 8)];
+            uint8_t high_2 = hex_values[(uint8_t)(digits >> 16)];
+            uint8_t low_2 = hex_values[(uint8_t)(digits >> 24)];
 
-            string[position * 2 + 1 - place] = digit;
+            valid &= high_1 & low_1 & high_2 & low_2;
+
+            data[position] = (uint8_t)((high_1 << 4) | (low_1 & 0x0f));
+            data[position + 1] = (uint8_t)((high_2 << 4) | (low_2 & 0x0f));
         }
     }
 
+    for (; position < length; position++) {
+        data[position] = read_hex_byte(&string[position * 2], &valid);
+    }
+
+    return valid != 0;
+}
+
+#else
+
+static char write_hex_digit(uint8_t value)
+{
+    return (char)((value < 10) ? '0' + value : 'a' + value - 10);
+}
+
+static bool write_hex(const uint8_t *data, char *string, size_t length)
+{
+    for (size_t position = 0; position < length; position++) {
+        string[position * 2] = write_hex_digit(data[position] >> 4);
+        string[position * 2 + 1] = write_hex_digit(data[position] & 0x0f);
+    }
+
     string[length * 2] = '\0';
 
     return true;
 }
 
-static bool read_hex(const char *string, uint8_t *data, size_t length)
+// Returns the value of a digit, or a value above 0x0f for other characters
+static uint8_t read_hex_digit(char digit)
 {
-    for (size_t position = 0; position < length; position++) {
-        uint8_t value = 0;
+    if ((digit >= '0') && (digit <= '9')) {
+        return (uint8_t)(digit - '0');
+    }
 
-        for (size_t place = 0; place < 2; place++) {
-            char digit = string[position * 2 + place];
+    // Folds upper case letters into lower case ones
+    digit |= 0x20;
 
-            value <<= 4;
+    if ((digit >= 'a') && (digit <= 'f')) {
+        return (uint8_t)(digit - 'a' + 10);
+    }
 
-            if ((digit >= '0') && (digit <= '9')) {
-                value += digit - '0';
-            } else if ((digit >= 'a') && (digit <= 'f')) {
-                value += digit - 'a' + 10;
-            } else {
-                return false;
-            }
+    return 0xff;
+}
+
+static bool read_hex(const char *string, uint8_t *data, size_t length)
+{
+    for (size_t position = 0; position < length; position++) {
+        uint8_t high = read_hex_digit(string[position * 2]);
+        uint8_t low = read_hex_digit(string[position * 2 + 1]);
+
+        if ((high > 0x0f) || (low > 0x0f)) {
+            return false;
         }
 
-        data[position] = value;
+        data[position] = (uint8_t)((high << 4) | low);
     }
 
     return true;
 }
 
+#endif
+
 static int read_hex_u8(const char *string)
 {
     uint8_t byte;
@@ -74,9 +194,9 @@ static int read_hex_u8(const char *string)
     return byte;
 }
 
-static int read_u16(const char *string)
+static int32_t read_decimal(const char *string, int32_t limit)
 {
-    int value = 0;
+    int32_t value = 0;
 
     const char *pointer = string;
     while (*pointer != '\0') {
@@ -86,7 +206,7 @@ static int read_u16(const char *string)
             value *= 10;
             value += digit - '0';
 
-            if (value > UINT16_MAX) {
+            if (value > limit) {
                 return -1;
             }
         } else {
@@ -99,346 +219,2654 @@ static int read_u16(const char *string)
     return value;
 }
 
-static void send_ok(void)
+static int read_u16(const char *string)
 {
-    const char *answer = "OK\r\n";
-    usb_send((const uint8_t *)answer, strlen(answer));
+    return (int)read_decimal(string, UINT16_MAX);
 }
 
-static void send_data(const uint8_t *data, size_t length)
+static size_t write_u16(uint16_t value, char *string)
 {
-    const char *header = "DATA ";
-    usb_send((const uint8_t *)header, strlen(header));
+    char digits[5];
+    size_t length = 0;
+
+    do {
+        digits[length] = (char)('0' + value % 10);
+        value /= 10;
+        length++;
+    } while (value != 0);
 
     for (size_t position = 0; position < length; position++) {
-        char string[3];
-        write_hex(&data[position], string, 1);
-        usb_send((const uint8_t *)string, 2);
+        string[position] = digits[length - 1 - position];
     }
 
-    const char *trailer = "\r\n";
-    usb_send((const uint8_t *)trailer, strlen(trailer));
+    string[length] = '\0';
+
+    return length;
 }
 
-static void send_error(void)
+static bool binary_mode = false;
+
+static bool tagged = false;
+static uint16_t tag;
+
+/*
+ * Binary mode frames, both directions: one length byte counting the rest
+ * of the frame, then the body. Request bodies start with an opcode and
+ * carry the same fields as the text commands, with addresses as single
+ * bytes, lengths as little-endian 16-bit values and payloads as raw
+ * bytes. A read length of zero stands for 65536 bytes. Response bodies
+ * start with a status byte followed by any data.
+ *
+ * Reads longer than MAX_DATA_LENGTH are answered with a series of OK
+ * frames carrying the data in chunks, or an ERROR frame if the transfer
+ * fails part way.
+ *
+ * Samples taken by a SAMPLE job arrive unsolicited as SAMPLE frames whose
+ * body holds the job slot, a 32-bit little-endian tick count and the data
+ * read, which is left out if the read failed. WATCH jobs report the same
+ * way with WATCH frames, but only when the masked data changes or the
+ * read starts or stops failing.
+ *
+ * Setting the top bit of the opcode marks a tagged request: a 16-bit
+ * little-endian tag follows the opcode and is echoed after the status
+ * byte, which then has its top bit set as well.
+ *
+ * A transfer is answered once the next command has been parsed. Tagged
+ * commands that leave the bus alone, PING, SAMPLE, WATCH and CANCEL, are
+ * answered right away instead, ahead of a transfer still on the bus, so
+ * tagged answers can arrive out of order. A job that becomes due waits
+ * for that transfer only, not for the host to stop sending commands.
+ *
+ * A BATCH body is a flags byte followed by operations, each encoded as
+ * the body of the corresponding single command. Its answer carries a
+ * status byte per executed operation, followed by the bytes read if the
+ * operation succeeded. That OK frame never starts with an encoding byte.
+ *
+ * After COMPRESS 1, in either mode, data in DATA answers, OK frames other
+ * than that of BATCH and SAMPLE and WATCH events starts with an encoding
+ * byte:
+ *
+ * 0x00  raw data follows
+ * 0x01  the data is run-length encoded
+ * 0x02  the XOR of the data with the previous data is run-length encoded
+ *
+ * The previous data is the last answer to a READ or WRITE_READ that was
+ * not streamed, or the last data reported by the same job slot. Delta
+ * encoding is only used when that answer was for the same address,
+ * register and length. Streamed reads carry the encoding byte in front of
+ * the first chunk only and are always run-length encoded.
+ *
+ * READ_PEC, WRITE_PEC and WRITE_READ_PEC take the same fields as their
+ * plain counterparts and have the peripheral append an SMBus PEC byte to
+ * the write, or check the one that ends the read. A PEC mismatch on a
+ * read is answered with PEC_ERROR, a PEC_ERROR frame or a PEC_ERROR
+ * batch status instead of ERROR.
+ *
+ * BLOCK_READ writes its data, normally an SMBus command code, and reads
+ * back a block whose length the target gives in its first byte.
+ * BLOCK_PROCESS_CALL takes the command code and the block to send, and
+ * adds the count byte in front of that block itself. Both answer with the
+ * block read, without its count byte. BLOCK_READ_PEC and
+ * BLOCK_PROCESS_CALL_PEC also check the PEC byte that ends the block.
+ *
+ * Run-length encoded data is a series of packets: a control byte below
+ * 0x80 is followed by that many plus one literal bytes, any other control
+ * byte is followed by a single byte repeated (control - 0x80 + 3) times.
+ */
+
+enum
 {
-    const char *answer = "ERROR\r\n";
-    usb_send((const uint8_t *)answer, strlen(answer));
-}
+    BINARY_OPCODE_PING = 0x00,
+    BINARY_OPCODE_READ = 0x01,
+    BINARY_OPCODE_WRITE = 0x02,
+    BINARY_OPCODE_WRITE_READ = 0x03,
+    BINARY_OPCODE_WRITE_WRITE = 0x04,
+    BINARY_OPCODE_BATCH = 0x05,
+    BINARY_OPCODE_BINARY = 0x06,
+    BINARY_OPCODE_TEXT = 0x07,
+    BINARY_OPCODE_SAMPLE = 0x08,
+    BINARY_OPCODE_CANCEL = 0x09,
+    BINARY_OPCODE_WATCH = 0x0a,
+    BINARY_OPCODE_SCAN = 0x0b,
+    BINARY_OPCODE_MACRO = 0x0c,
+    BINARY_OPCODE_MACRO_BEGIN = 0x0d,
+    BINARY_OPCODE_MACRO_ERASE = 0x0e,
+    BINARY_OPCODE_COMPRESS = 0x0f,
+    BINARY_OPCODE_POLL = 0x10,
+    BINARY_OPCODE_EEPROM = 0x11,
+    BINARY_OPCODE_EEPROM_WRITE = 0x12,
+    BINARY_OPCODE_SPEED = 0x13,
+    BINARY_OPCODE_PROFILE = 0x14,
+    BINARY_OPCODE_TIMEOUT = 0x15,
+    BINARY_OPCODE_BUSRESET = 0x16,
+    BINARY_OPCODE_READ_PEC = 0x17,
+    BINARY_OPCODE_WRITE_PEC = 0x18,
+    BINARY_OPCODE_WRITE_READ_PEC = 0x19,
+    BINARY_OPCODE_BLOCK_READ = 0x1a,
+    BINARY_OPCODE_BLOCK_PROCESS_CALL = 0x1b,
+    BINARY_OPCODE_BLOCK_READ_PEC = 0x1c,
+    BINARY_OPCODE_BLOCK_PROCESS_CALL_PEC = 0x1d,
+    BINARY_OPCODE_COUNT,
+    BINARY_OPCODE_MASK = 0x7f
+};
+
+enum
+{
+    BINARY_STATUS_OK = 0x00,
+    BINARY_STATUS_ERROR = 0x01,
+    BINARY_STATUS_SAMPLE = 0x02,
+    BINARY_STATUS_WATCH = 0x03,
+    BINARY_STATUS_PEC_ERROR = 0x04,
+    BINARY_FLAG_TAGGED = 0x80
+};
 
 #define MAX_DATA_LENGTH 64
+#define MAX_REGISTER_LENGTH 4
 
-static void shell_process_command(char *command)
-{
-    const char *action = strtok(command, " ");
-    if (!action) {
-        send_error();
-        return;
-    }
+#if FEATURE_STREAM
+// Longer reads are streamed in chunks instead of being buffered, up to a
+// whole 64 KiB EEPROM in one transfer
+#define MAX_READ_LENGTH (UINT16_MAX + 1)
+#define STREAM_CHUNK_LENGTH 32
+#else
+#define MAX_READ_LENGTH MAX_DATA_LENGTH
+#endif
 
-    if (strcmp(action, "PING") == 0) {
-        send_ok();
-    } else if (strcmp(action, "READ") == 0) {
-        const char *address_token = strtok(NULL, " ");
-        if (!address_token) {
-            send_error();
-            return;
-        }
+// Large enough for a tagged DATA answer carrying MAX_DATA_LENGTH bytes
+#define MAX_RESPONSE_LENGTH (sizeof("#65535 DATA \r\n") - 1 + \
+                             MAX_DATA_LENGTH * 2)
 
-        if (strlen(address_token) != 2) {
-            send_error();
-            return;
-        }
+// One spare byte for the terminator written by write_hex()
+static uint8_t response_buffer[MAX_RESPONSE_LENGTH + 1];
+static size_t response_length = 0;
 
-        int address_value = read_hex_u8(address_token);
-        if (address_value <= 0) {
-            send_error();
-            return;
+static bool response_muted = false;
+static bool response_failed = false;
+
+static void response_flush(void)
+{
+    if (response_length > 0) {
+        if (!response_muted) {
+            usb_send(response_buffer, response_length);
         }
 
-        uint8_t address = (uint8_t)address_value;
+        response_length = 0;
+    }
+}
 
-        const char *length_token = strtok(NULL, " ");
-        if (!length_token) {
-            send_error();
-            return;
+static void response_append(const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+
+    while (length > 0) {
+        if (response_length == MAX_RESPONSE_LENGTH) {
+            response_flush();
         }
 
-        int length_value = read_u16(length_token);
-        if ((length_value <= 0) || (length_value > MAX_DATA_LENGTH)) {
-            send_error();
-            return;
+        size_t chunk = MAX_RESPONSE_LENGTH - response_length;
+        if (chunk > length) {
+            chunk = length;
         }
 
-        size_t length = (size_t)length_value;
+        memcpy(&response_buffer[response_length], bytes, chunk);
+        response_length += chunk;
 
-        uint8_t data[MAX_DATA_LENGTH];
-        if (!i2c_read(address, data, length)) {
-            send_error();
-            return;
-        }
+        bytes += chunk;
+        length -= chunk;
+    }
+}
 
-        send_data(data, length);
-    } else if (strcmp(action, "WRITE") == 0) {
-        const char *address_token = strtok(NULL, " ");
-        if (!address_token) {
-            send_error();
-            return;
-        }
+static void response_append_string(const char *string)
+{
+    response_append(string, strlen(string));
+}
 
-        if (strlen(address_token) != 2) {
-            send_error();
-            return;
+static void response_append_hex(const uint8_t *data, size_t length)
+{
+    while (length > 0) {
+        if (MAX_RESPONSE_LENGTH - response_length < 2) {
+            response_flush();
         }
 
-        int address_value = read_hex_u8(address_token);
-        if (address_value <= 0) {
-            send_error();
-            return;
+        size_t chunk = (MAX_RESPONSE_LENGTH - response_length) / 2;
+        if (chunk > length) {
+            chunk = length;
         }
 
-        uint8_t address = (uint8_t)address_value;
+        write_hex(data, (char *)&response_buffer[response_length], chunk);
+        response_length += chunk * 2;
 
-        const char *length_token = strtok(NULL, " ");
-        if (!length_token) {
-            send_error();
-            return;
-        }
+        data += chunk;
+        length -= chunk;
+    }
+}
 
-        int length_value = read_u16(length_token);
-        if ((length_value <= 0) || (length_value > MAX_DATA_LENGTH)) {
-            send_error();
-            return;
-        }
+#if FEATURE_COMPRESSION
 
-        size_t length = (size_t)length_value;
+enum
+{
+    ENCODING_RAW = 0x00,
+    ENCODING_RLE = 0x01,
+    ENCODING_DELTA = 0x02
+};
 
-        const char *data_token = strtok(NULL, " ");
-        if (!data_token) {
-            send_error();
-            return;
-        }
+#define RUN_FLAG 0x80
+#define MIN_RUN_LENGTH 3
+#define MAX_RUN_LENGTH (0x7f + MIN_RUN_LENGTH)
+#define MAX_LITERAL_LENGTH 0x80
 
-        if (strlen(data_token) != length * 2) {
-            send_error();
-            return;
-        }
+static bool compression = false;
 
-        uint8_t data[MAX_DATA_LENGTH];
-        if (!read_hex(data_token, data, length))
-        {
-            send_error();
-            return;
-        }
+// Also fits a run-length encoded stream chunk, which grows by one byte at most
+static uint8_t encode_buffer[MAX_DATA_LENGTH + 1];
 
-        if (!i2c_write(address, data, length)) {
-            send_error();
-            return;
-        }
+struct rle_output
+{
+    uint8_t *data;
+    size_t length;
+    size_t limit;
+};
+
+static uint8_t rle_byte(const uint8_t *data,
+                        const uint8_t *previous,
+                        size_t position)
+{
+    if (previous) {
+        return data[position] ^ previous[position];
+    }
 
-        send_ok();
-    } else if (strcmp(action, "WRITE_READ") == 0) {
-        const char *address_token = strtok(NULL, " ");
-        if (!address_token) {
-            send_error();
-            return;
-        }
+    return data[position];
+}
 
-        if (strlen(address_token) != 2) {
-            send_error();
-            return;
+static bool rle_append_literal(struct rle_output *output,
+                               const uint8_t *data,
+                               const uint8_t *previous,
+                               size_t start,
+                               size_t end)
+{
+    while (start < end) {
+        size_t count = end - start;
+        if (count > MAX_LITERAL_LENGTH) {
+            count = MAX_LITERAL_LENGTH;
         }
 
-        int address_value = read_hex_u8(address_token);
-        if (address_value <= 0) {
-            send_error();
-            return;
+        if (output->limit - output->length < count + 1) {
+            return false;
         }
 
-        uint8_t address = (uint8_t)address_value;
+        output->data[output->length++] = (uint8_t)(count - 1);
 
-        const char *length_1_token = strtok(NULL, " ");
-        if (!length_1_token) {
-            send_error();
-            return;
+        for (size_t position = start; position < start + count; position++) {
+            output->data[output->length++] =
+                rle_byte(data, previous, position);
         }
 
-        int length_1_value = read_u16(length_1_token);
-        if ((length_1_value <= 0) || (length_1_value > MAX_DATA_LENGTH)) {
-            send_error();
-            return;
-        }
+        start += count;
+    }
 
-        size_t length_1 = (size_t)length_1_value;
+    return true;
+}
 
-        const char *data_1_token = strtok(NULL, " ");
-        if (!data_1_token) {
-            send_error();
-            return;
-        }
+// Fails once the output would grow beyond output->limit bytes
+static bool rle_encode(struct rle_output *output,
+                       const uint8_t *data,
+                       const uint8_t *previous,
+                       size_t length)
+{
+    size_t literal_start = 0;
+    size_t position = 0;
 
-        if (strlen(data_1_token) != length_1 * 2) {
-            send_error();
-            return;
-        }
+    output->length = 0;
 
-        uint8_t data_1[MAX_DATA_LENGTH];
-        if (!read_hex(data_1_token, data_1, length_1))
-        {
-            send_error();
-            return;
+    while (position < length) {
+        uint8_t value = rle_byte(data, previous, position);
+
+        size_t run = 1;
+        while ((position + run < length) && (run < MAX_RUN_LENGTH) &&
+               (rle_byte(data, previous, position + run) == value)) {
+            run++;
         }
 
-        const char *length_2_token = strtok(NULL, " ");
-        if (!length_2_token) {
-            send_error();
-            return;
+        if (run < MIN_RUN_LENGTH) {
+            position += run;
+            continue;
         }
 
-        int length_2_value = read_u16(length_2_token);
-        if ((length_2_value <= 0) || (length_2_value > MAX_DATA_LENGTH)) {
-            send_error();
-            return;
+        if (!rle_append_literal(output, data, previous,
+                                literal_start, position) ||
+            (output->limit - output->length < 2)) {
+            return false;
         }
 
-        size_t length_2 = (size_t)length_2_value;
+        output->data[output->length++] =
+            (uint8_t)(RUN_FLAG | (run - MIN_RUN_LENGTH));
+        output->data[output->length++] = value;
 
-        uint8_t data_2[MAX_DATA_LENGTH];
-        if (!i2c_write_read(address, data_1, length_1, data_2, length_2)) {
-            send_error();
-            return;
-        }
+        position += run;
+        literal_start = position;
+    }
 
-        send_data(data_2, length_2);
-    } else if (strcmp(action, "WRITE_WRITE") == 0) {
-        const char *address_token = strtok(NULL, " ");
-        if (!address_token) {
-            send_error();
-            return;
-        }
+    return rle_append_literal(output, data, previous, literal_start, length);
+}
 
-        if (strlen(address_token) != 2) {
-            send_error();
-            return;
-        }
+// Encodes data into encode_buffer, keeping it raw unless encoding pays off
+static size_t encode_data(const uint8_t *data,
+                          const uint8_t *previous,
+                          size_t length)
+{
+    struct rle_output output = {
+        &encode_buffer[1], 0, (length > 0) ? length - 1 : 0
+    };
+
+    if (previous && rle_encode(&output, data, previous, length)) {
+        encode_buffer[0] = ENCODING_DELTA;
+    } else if (rle_encode(&output, data, NULL, length)) {
+        encode_buffer[0] = ENCODING_RLE;
+    } else {
+        encode_buffer[0] = ENCODING_RAW;
+        memcpy(&encode_buffer[1], data, length);
+        output.length = length;
+    }
 
-        int address_value = read_hex_u8(address_token);
-        if (address_value <= 0) {
-            send_error();
-            return;
-        }
+    return output.length + 1;
+}
 
-        uint8_t address = (uint8_t)address_value;
+#endif
 
-        const char *length_1_token = strtok(NULL, " ");
-        if (!length_1_token) {
-            send_error();
-            return;
-        }
+static void send_frame_header(uint8_t status, size_t length)
+{
+    if (tagged) {
+        uint8_t header[4] = {(uint8_t)(length + 3),
+                             status | BINARY_FLAG_TAGGED,
+                             (uint8_t)tag,
+                             (uint8_t)(tag >> 8)};
+        response_append(header, sizeof(header));
+    } else {
+        uint8_t header[2] = {(uint8_t)(length + 1), status};
+        response_append(header, sizeof(header));
+    }
+}
 
-        int length_1_value = read_u16(length_1_token);
-        if ((length_1_value <= 0) || (length_1_value > MAX_DATA_LENGTH)) {
-            send_error();
-            return;
-        }
+static void send_frame(uint8_t status, const uint8_t *data, size_t length)
+{
+    send_frame_header(status, length);
+    response_append(data, length);
+    response_flush();
+}
 
-        size_t length_1 = (size_t)length_1_value;
+static void send_tag(void)
+{
+    if (!tagged) {
+        return;
+    }
 
-        const char *data_1_token = strtok(NULL, " ");
-        if (!data_1_token) {
-            send_error();
-            return;
-        }
+    char string[8] = "#";
+    size_t length = write_u16(tag, &string[1]) + 1;
+    string[length] = ' ';
+    response_append(string, length + 1);
+}
 
-        if (strlen(data_1_token) != length_1 * 2) {
-            send_error();
-            return;
-        }
+static void send_ok(void)
+{
+    if (binary_mode) {
+        send_frame(BINARY_STATUS_OK, NULL, 0);
+        return;
+    }
 
-        uint8_t data_1[MAX_DATA_LENGTH];
-        if (!read_hex(data_1_token, data_1, length_1))
-        {
-            send_error();
-            return;
-        }
+    send_tag();
+    response_append_string("OK\r\n");
+    response_flush();
+}
 
-        const char *length_2_token = strtok(NULL, " ");
-        if (!length_2_token) {
-            send_error();
-            return;
-        }
+static void send_data_delta(const uint8_t *data,
+                            const uint8_t *previous,
+                            size_t length)
+{
+#if FEATURE_COMPRESSION
+    if (compression) {
+        length = encode_data(data, previous, length);
+        data = encode_buffer;
+    }
+#else
+    (void)previous;
+#endif
 
-        int length_2_value = read_u16(length_2_token);
-        if ((length_2_value <= 0) || (length_2_value > MAX_DATA_LENGTH)) {
-            send_error();
-            return;
-        }
+    if (binary_mode) {
+        send_frame(BINARY_STATUS_OK, data, length);
+        return;
+    }
 
-        size_t length_2 = (size_t)length_2_value;
+    send_tag();
+    response_append_string("DATA ");
+    response_append_hex(data, length);
+    response_append_string("\r\n");
+    response_flush();
+}
 
-        const char *data_2_token = strtok(NULL, " ");
-        if (!data_2_token) {
-            send_error();
-            return;
-        }
+static void send_data(const uint8_t *data, size_t length)
+{
+    send_data_delta(data, NULL, length);
+}
 
-        if (strlen(data_2_token) != length_2 * 2) {
-            send_error();
-            return;
-        }
+static void send_failure(uint8_t status, const char *string)
+{
+    response_failed = true;
 
-        uint8_t data_2[MAX_DATA_LENGTH];
-        if (!read_hex(data_2_token, data_2, length_2))
-        {
-            send_error();
-            return;
-        }
+    if (binary_mode) {
+        send_frame(status, NULL, 0);
+        return;
+    }
 
-        if (!i2c_write_write(address, data_1, length_1, data_2, length_2)) {
-            send_error();
-            return;
-        }
+    send_tag();
+    response_append_string(string);
+    response_flush();
+}
 
-        send_ok();
+static void send_error(void)
+{
+    send_failure(BINARY_STATUS_ERROR, "ERROR\r\n");
+}
+
+static void send_transfer_error(bool pec_error)
+{
+    if (pec_error) {
+        send_failure(BINARY_STATUS_PEC_ERROR, "PEC_ERROR\r\n");
     } else {
         send_error();
     }
-
-    return;
 }
 
-bool is_character(uint8_t byte)
+
+#define MAX_WRITE_SEGMENTS 2
+
+struct shell_arguments
 {
-    return (byte >= ' ') && (byte <= '~');
-}
+    uint32_t read_length;
+    uint16_t number;
+    uint8_t address;
+    uint8_t write_count;
+    bool pec;
+    uint16_t write_lengths[MAX_WRITE_SEGMENTS];
+    const uint8_t *write_data[MAX_WRITE_SEGMENTS];
+};
+
+/*
+ * Argument schema characters:
+ *   'a' - target address
+ *   'w' - length followed by data to write
+ *   'r' - length of data to read
+ *   'n' - decimal number, such as a period or a job slot
+ *   'p' - no field, the transfer is checked with an SMBus PEC
+ *   '*' - trailing arguments parsed by the handler itself
+ */
+
+struct shell_command
+{
+    const char *name;
+    const char *schema;
+    bool (*transfer)(const struct shell_arguments *arguments, uint8_t *data);
+    void (*handler)(const struct shell_command *command,
+                    const struct shell_arguments *arguments);
+};
 
-#define MAX_COMMAND_LENGTH 511
+static char *text_position;
 
-noreturn static void shell_task(void *parameter)
+static const uint8_t *frame_position;
+static const uint8_t *frame_end;
+
+static char *next_token(void)
 {
-    (void)parameter;
+    while (*text_position == ' ') {
+        text_position++;
+    }
 
-    static uint8_t command_buffer[MAX_COMMAND_LENGTH + 1];
-    size_t command_length = 0;
+    if (*text_position == '\0') {
+        return NULL;
+    }
 
-    for (;;) {
-        uint8_t byte;
+    char *token = text_position;
 
-        if (usb_recv(&byte, 1) == 0) {
-            continue;
-        }
+    while ((*text_position != ' ') && (*text_position != '\0')) {
+        text_position++;
+    }
 
-        if ((byte == '\n') || (byte == '\r')) {
-            if (command_length != 0) {
-                command_buffer[command_length] = '\0';
-                shell_process_command((char *)command_buffer);
-                command_length = 0;
-            }
-        } else if (is_character(byte)) {
-            if (command_length < MAX_COMMAND_LENGTH) {
-                command_buffer[command_length] = byte;
-                command_length++;
-            }
+    if (*text_position == ' ') {
+        *text_position++ = '\0';
+    }
+
+    return token;
+}
+
+#if FEATURE_BATCH
+
+static bool next_token_is(const char *word)
+{
+    while (*text_position == ' ') {
+        text_position++;
+    }
+
+    size_t length = strlen(word);
+
+    if ((strncmp(text_position, word, length) != 0) ||
+        ((text_position[length] != ' ') && (text_position[length] != '\0'))) {
+        return false;
+    }
+
+    text_position += length;
+
+    return true;
+}
+
+#endif
+
+static bool next_byte(uint8_t *byte)
+{
+    if (frame_position == frame_end) {
+        return false;
+    }
+
+    *byte = *frame_position++;
+
+    return true;
+}
+
+static bool next_u16(uint16_t *value)
+{
+    if (frame_end - frame_position < 2) {
+        return false;
+    }
+
+    *value = frame_position[0] | (frame_position[1] << 8);
+    frame_position += 2;
+
+    return true;
+}
+
+static bool arguments_end(void)
+{
+    if (binary_mode) {
+        return frame_position == frame_end;
+    }
+
+    while (*text_position == ' ') {
+        text_position++;
+    }
+
+    return *text_position == '\0';
+}
+
+static bool decode_address(uint8_t *address)
+{
+    if (binary_mode) {
+        if (!next_byte(address)) {
+            return false;
+        }
+    } else {
+        const char *token = next_token();
+        if (!token || (strlen(token) != 2)) {
+            return false;
+        }
+
+        int value = read_hex_u8(token);
+        if (value < 0) {
+            return false;
+        }
+
+        *address = (uint8_t)value;
+    }
+
+    return *address != 0;
+}
+
+static bool decode_length(uint16_t *length, uint16_t limit)
+{
+    if (binary_mode) {
+        if (!next_u16(length)) {
+            return false;
+        }
+    } else {
+        const char *token = next_token();
+        if (!token) {
+            return false;
+        }
+
+        int value = read_u16(token);
+        if (value < 0) {
+            return false;
+        }
+
+        *length = (uint16_t)value;
+    }
+
+    return (*length > 0) && (*length <= limit);
+}
+
+// Binary mode has no room for 65536 in a length, so a zero stands for it
+static bool decode_read_length(uint32_t *length)
+{
+    if (binary_mode) {
+        uint16_t value;
+
+        if (!next_u16(&value)) {
+            return false;
+        }
+
+        *length = (value == 0) ? UINT16_MAX + 1 : value;
+
+        return *length <= MAX_READ_LENGTH;
+    }
+
+    const char *token = next_token();
+    if (!token) {
+        return false;
+    }
+
+    int32_t value = read_decimal(token, MAX_READ_LENGTH);
+    if (value <= 0) {
+        return false;
+    }
+
+    *length = (uint32_t)value;
+
+    return true;
+}
+
+static bool decode_number(uint16_t *number)
+{
+    if (binary_mode) {
+        return next_u16(number);
+    }
+
+    const char *token = next_token();
+    if (!token) {
+        return false;
+    }
+
+    int value = read_u16(token);
+    if (value < 0) {
+        return false;
+    }
+
+    *number = (uint16_t)value;
+
+    return true;
+}
+
+// Starts on a text command, taking the tag in front of it if there is one
+static bool decode_tag(char *command)
+{
+    tagged = false;
+
+    text_position = command;
+
+    if (*text_position != '#') {
+        return true;
+    }
+
+    const char *token = next_token();
+    int tag_value = read_u16(&token[1]);
+    if ((tag_value < 0) || (token[1] == '\0')) {
+        return false;
+    }
+
+    tag = (uint16_t)tag_value;
+    tagged = true;
+
+    return true;
+}
+
+#if FEATURE_BATCH
+
+#define MAX_BATCH_RESULT_LENGTH 252
+
+static uint8_t batch_results[MAX_BATCH_RESULT_LENGTH];
+
+// Set while BATCH checks its operations, which must leave the text intact
+static bool batch_validating = false;
+
+#endif
+
+static bool decode_data(size_t length, const uint8_t **data)
+{
+    if (binary_mode) {
+        if ((size_t)(frame_end - frame_position) < length) {
+            return false;
+        }
+
+        *data = frame_position;
+        frame_position += length;
+
+        return true;
+    }
+
+    char *token = next_token();
+    if (!token || (strlen(token) != length * 2)) {
+        return false;
+    }
+
+    // Decoding in place is safe since every byte is stored behind its digits
+    uint8_t *decoded = (uint8_t *)token;
+
+#if FEATURE_BATCH
+    if (batch_validating) {
+        decoded = batch_results;
+    }
+#endif
+
+    if (!read_hex(token, decoded, length)) {
+        return false;
+    }
+
+    *data = decoded;
+
+    return true;
+}
+
+static bool decode_arguments(const struct shell_command *command,
+                             struct shell_arguments *arguments)
+{
+    arguments->write_count = 0;
+    arguments->read_length = 0;
+    arguments->pec = false;
+
+    for (const char *kind = command->schema; *kind != '\0'; kind++) {
+        switch (*kind) {
+        case 'a':
+            if (!decode_address(&arguments->address)) {
+                return false;
+            }
+            break;
+
+        case 'w': {
+            uint8_t segment = arguments->write_count++;
+
+            if (!decode_length(&arguments->write_lengths[segment],
+                               MAX_DATA_LENGTH) ||
+                !decode_data(arguments->write_lengths[segment],
+                             &arguments->write_data[segment])) {
+                return false;
+            }
+            break;
+        }
+
+        case 'r':
+            if (!decode_read_length(&arguments->read_length)) {
+                return false;
+            }
+            break;
+
+        case 'n':
+            if (!decode_number(&arguments->number)) {
+                return false;
+            }
+            break;
+
+        case 'p':
+            arguments->pec = true;
+            break;
+
+        case '*':
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static const struct shell_command *decode_command(void);
+
+static bool transfer_read(const struct shell_arguments *arguments,
+                          uint8_t *data)
+{
+    return i2c_read(arguments->address, data, arguments->read_length);
+}
+
+static bool transfer_write(const struct shell_arguments *arguments,
+                           uint8_t *data)
+{
+    (void)data;
+
+    return i2c_write(arguments->address,
+                     arguments->write_data[0], arguments->write_lengths[0]);
+}
+
+static bool transfer_write_read(const struct shell_arguments *arguments,
+                                uint8_t *data)
+{
+    return i2c_write_read(arguments->address,
+                          arguments->write_data[0],
+                          arguments->write_lengths[0],
+                          data, arguments->read_length);
+}
+
+static bool transfer_write_write(const struct shell_arguments *arguments,
+                                 uint8_t *data)
+{
+    (void)data;
+
+    return i2c_write_write(arguments->address,
+                           arguments->write_data[0],
+                           arguments->write_lengths[0],
+                           arguments->write_data[1],
+                           arguments->write_lengths[1]);
+}
+
+#if FEATURE_EEPROM
+
+static bool transfer_poll(const struct shell_arguments *arguments,
+                          uint8_t *data)
+{
+    (void)data;
+
+    return i2c_poll(arguments->address, arguments->number);
+}
+
+#endif
+
+// Other users of the bus never see PEC left enabled
+static bool shell_transfer(const struct shell_command *command,
+                           const struct shell_arguments *arguments,
+                           uint8_t *data)
+{
+    i2c_set_pec(arguments->pec);
+
+    bool success = command->transfer(arguments, data);
+
+    i2c_set_pec(false);
+
+    return success;
+}
+
+static void command_ping(const struct shell_command *command,
+                         const struct shell_arguments *arguments)
+{
+    (void)command;
+    (void)arguments;
+
+    send_ok();
+}
+
+#if FEATURE_STREAM
+
+static bool stream_started;
+
+static void send_stream_chunk(const uint8_t *data, size_t length)
+{
+    bool first = !stream_started;
+
+    stream_started = true;
+
+#if FEATURE_COMPRESSION
+    if (compression) {
+        size_t offset = 0;
+
+        if (first) {
+            encode_buffer[offset++] = ENCODING_RLE;
+        }
+
+        struct rle_output output = {
+            &encode_buffer[offset], 0, sizeof(encode_buffer) - offset
+        };
+
+        rle_encode(&output, data, NULL, length);
+
+        data = encode_buffer;
+        length = offset + output.length;
+    }
+#endif
+
+    if (binary_mode) {
+        send_frame(BINARY_STATUS_OK, data, length);
+        return;
+    }
+
+    if (first) {
+        send_tag();
+        response_append_string("DATA ");
+    }
+
+    response_append_hex(data, length);
+    response_flush();
+}
+
+// A DATA line already under way can only be ended with a trailing error
+static void send_stream_end(bool success, bool pec_error)
+{
+    if (binary_mode || !stream_started) {
+        if (!success) {
+            send_transfer_error(pec_error);
+        }
+        return;
+    }
+
+    if (success) {
+        response_append_string("\r\n");
+    } else {
+        response_append_string(pec_error ? " PEC_ERROR\r\n" : " ERROR\r\n");
+    }
+    response_flush();
+}
+
+static void command_stream(const struct shell_arguments *arguments)
+{
+    static uint8_t buffer[STREAM_CHUNK_LENGTH * 2];
+
+    const uint8_t *data = NULL;
+    size_t length = 0;
+
+    if (arguments->write_count > 0) {
+        data = arguments->write_data[0];
+        length = arguments->write_lengths[0];
+    }
+
+    stream_started = false;
+
+    i2c_set_pec(arguments->pec);
+
+    bool success = i2c_write_read_stream(arguments->address,
+                                         data, length,
+                                         buffer, STREAM_CHUNK_LENGTH,
+                                         arguments->read_length,
+                                         send_stream_chunk);
+
+    i2c_set_pec(false);
+
+    send_stream_end(success, arguments->pec && i2c_pec_error());
+}
+
+#endif
+
+#if FEATURE_COMPRESSION
+
+static struct
+{
+    bool valid;
+    uint8_t address;
+    uint8_t write_length;
+    uint8_t read_length;
+    uint8_t write_data[MAX_REGISTER_LENGTH];
+    uint8_t data[MAX_DATA_LENGTH];
+} previous_read;
+
+// Keeps the answer the host has last seen for delta encoding of the next one
+static void send_read_data(const struct shell_arguments *arguments,
+                           const uint8_t *data)
+{
+    size_t write_length = 0;
+
+    if (arguments->write_count > 0) {
+        write_length = arguments->write_lengths[0];
+    }
+
+    if (!compression || response_muted) {
+        send_data(data, arguments->read_length);
+        return;
+    }
+
+    if (write_length > MAX_REGISTER_LENGTH) {
+        previous_read.valid = false;
+        send_data(data, arguments->read_length);
+        return;
+    }
+
+    bool same = previous_read.valid &&
+                (previous_read.address == arguments->address) &&
+                (previous_read.write_length == write_length) &&
+                (previous_read.read_length == arguments->read_length) &&
+                ((write_length == 0) ||
+                 (memcmp(previous_read.write_data,
+                         arguments->write_data[0], write_length) == 0));
+
+    send_data_delta(data, same ? previous_read.data : NULL,
+                    arguments->read_length);
+
+    previous_read.valid = true;
+    previous_read.address = arguments->address;
+    previous_read.write_length = (uint8_t)write_length;
+    previous_read.read_length = (uint8_t)arguments->read_length;
+    if (write_length > 0) {
+        memcpy(previous_read.write_data, arguments->write_data[0],
+               write_length);
+    }
+    memcpy(previous_read.data, data, arguments->read_length);
+}
+
+#else
+
+static void send_read_data(const struct shell_arguments *arguments,
+                           const uint8_t *data)
+{
+    send_data(data, arguments->read_length);
+}
+
+#endif
+
+static void command_transfer(const struct shell_command *command,
+                             const struct shell_arguments *arguments)
+{
+    uint8_t data[MAX_DATA_LENGTH];
+
+#if FEATURE_STREAM
+    if (arguments->read_length > MAX_DATA_LENGTH) {
+        command_stream(arguments);
+        return;
+    }
+#endif
+
+    if (!shell_transfer(command, arguments, data)) {
+        send_transfer_error(arguments->pec && i2c_pec_error());
+        return;
+    }
+
+    if (arguments->read_length > 0) {
+        send_read_data(arguments, data);
+    } else {
+        send_ok();
+    }
+}
+
+#if FEATURE_PIPELINE
+
+struct shell_transfer
+{
+    struct i2c_transaction transaction;
+    struct shell_arguments arguments;
+    bool tagged;
+    uint16_t tag;
+    uint8_t data[MAX_DATA_LENGTH];
+};
+
+// The transfer on the bus and the slot the next one is copied into
+static struct shell_transfer transfers[2];
+static struct shell_transfer *pending_transfer = &transfers[0];
+static bool transfer_pending = false;
+
+static void shell_answer_transfer(const struct shell_transfer *transfer)
+{
+    bool saved_tagged = tagged;
+    uint16_t saved_tag = tag;
+
+    tagged = transfer->tagged;
+    tag = transfer->tag;
+
+    if (!transfer->transaction.success) {
+        send_transfer_error(transfer->transaction.pec_error);
+    } else if (transfer->arguments.read_length > 0) {
+        send_read_data(&transfer->arguments, transfer->transaction.data_2);
+    } else {
+        send_ok();
+    }
+
+    tagged = saved_tagged;
+    tag = saved_tag;
+}
+
+// Answers the pending transfer once the bus is done with it
+static void shell_finish_transfers(void)
+{
+    if (!transfer_pending) {
+        return;
+    }
+
+    i2c_complete();
+
+    transfer_pending = false;
+
+    shell_answer_transfer(pending_transfer);
+}
+
+/*
+ * Starts a transfer on the bus if its data fits into a transfer slot. A
+ * transfer still pending is answered only once the new one has started,
+ * so the bus goes on while the answer is formatted and sent.
+ */
+static bool shell_submit_transfer(const struct shell_command *command,
+                                  const struct shell_arguments *arguments)
+{
+    size_t length = arguments->read_length;
+
+    for (size_t segment = 0; segment < arguments->write_count; segment++) {
+        length += arguments->write_lengths[segment];
+    }
+
+    if (length > MAX_DATA_LENGTH) {
+        return false;
+    }
+
+    struct shell_transfer *transfer = pending_transfer;
+
+    if (transfer_pending) {
+        transfer = (pending_transfer == &transfers[0]) ?
+                   &transfers[1] : &transfers[0];
+    }
+
+    struct i2c_transaction *transaction = &transfer->transaction;
+
+    transfer->arguments = *arguments;
+    transfer->tagged = tagged;
+    transfer->tag = tag;
+
+    uint8_t *data = transfer->data;
+
+    for (size_t segment = 0; segment < arguments->write_count; segment++) {
+        memcpy(data, arguments->write_data[segment],
+               arguments->write_lengths[segment]);
+        transfer->arguments.write_data[segment] = data;
+        data += arguments->write_lengths[segment];
+    }
+
+    transaction->address = arguments->address;
+    transaction->pec = arguments->pec;
+    transaction->data_1 = NULL;
+    transaction->size_1 = 0;
+    transaction->data_2 = data;
+    transaction->size_2 = arguments->read_length;
+
+    if (arguments->write_count > 0) {
+        transaction->data_1 = transfer->arguments.write_data[0];
+        transaction->size_1 = arguments->write_lengths[0];
+    }
+
+    if (arguments->write_count == 2) {
+        transaction->operation = I2C_OPERATION_WRITE_WRITE;
+        transaction->data_2 = (uint8_t *)transfer->arguments.write_data[1];
+        transaction->size_2 = arguments->write_lengths[1];
+    } else if (arguments->write_count == 0) {
+        transaction->operation = I2C_OPERATION_READ;
+    } else if (arguments->read_length > 0) {
+        transaction->operation = I2C_OPERATION_WRITE_READ;
+    } else {
+        transaction->operation = I2C_OPERATION_WRITE;
+    }
+
+#if FEATURE_EEPROM
+    if (command->transfer == transfer_poll) {
+        transaction->operation = I2C_OPERATION_POLL;
+        transaction->timeout = arguments->number;
+    }
+#endif
+
+    struct shell_transfer *previous = NULL;
+
+    if (transfer_pending) {
+        i2c_complete();
+        previous = pending_transfer;
+    }
+
+    i2c_submit(transaction);
+    pending_transfer = transfer;
+    transfer_pending = true;
+
+    if (previous) {
+        shell_answer_transfer(previous);
+    }
+
+    return true;
+}
+
+#else
+
+// Every transfer is answered before the next command is parsed
+static bool transfer_pending = false;
+
+static void shell_finish_transfers(void)
+{
+}
+
+#endif
+
+#if FEATURE_BATCH
+
+#define BATCH_FLAG_STOP 0x01
+
+static bool decode_batch_stop(void)
+{
+    if (binary_mode) {
+        uint8_t flags;
+
+        return next_byte(&flags) && ((flags & BATCH_FLAG_STOP) != 0);
+    }
+
+    return next_token_is("STOP");
+}
+
+// Returns the length of the answer if every operation is well formed
+static size_t batch_validate(void)
+{
+    size_t length = 0;
+
+    batch_validating = true;
+
+    while (!arguments_end()) {
+        const struct shell_command *operation = decode_command();
+        struct shell_arguments arguments;
+
+        if (!operation || !operation->transfer ||
+            !decode_arguments(operation, &arguments)) {
+            length = 0;
+            break;
+        }
+
+        length += 1 + arguments.read_length;
+    }
+
+    batch_validating = false;
+
+    return length;
+}
+
+static void send_batch_result(uint8_t status,
+                              const uint8_t *data,
+                              size_t length)
+{
+    if (status == BINARY_STATUS_PEC_ERROR) {
+        response_append_string(" PEC_ERROR");
+    } else if (status != BINARY_STATUS_OK) {
+        response_append_string(" ERROR");
+    } else if (length == 0) {
+        response_append_string(" OK");
+    } else {
+        response_append_string(" ");
+        response_append_hex(data, length);
+    }
+}
+
+/*
+ * Operations are decoded twice, once to check all of them before any is
+ * run and again to run them, so that no copy of them has to be kept.
+ * Text answers are sent as the operations run, binary ones are collected
+ * into a single frame.
+ */
+static void command_batch(const struct shell_command *command,
+                          const struct shell_arguments *arguments)
+{
+    (void)command;
+    (void)arguments;
+
+    bool stop = decode_batch_stop();
+
+    char *text_start = text_position;
+    char *text_end = binary_mode ?
+                     NULL : text_position + strlen(text_position);
+    const uint8_t *frame_start = frame_position;
+
+    size_t length = batch_validate();
+
+    if ((length == 0) || (length > MAX_BATCH_RESULT_LENGTH)) {
+        send_error();
+        return;
+    }
+
+    // The first pass split the text into tokens, join them up again
+    if (binary_mode) {
+        frame_position = frame_start;
+    } else {
+        for (char *position = text_start; position < text_end; position++) {
+            if (*position == '\0') {
+                *position = ' ';
+            }
+        }
+
+        text_position = text_start;
+
+        send_tag();
+        response_append_string("BATCH");
+    }
+
+    length = 0;
+
+    while (!arguments_end()) {
+        const struct shell_command *operation = decode_command();
+        struct shell_arguments operation_arguments;
+
+        decode_arguments(operation, &operation_arguments);
+
+        uint8_t *result = &batch_results[length];
+        bool success = shell_transfer(operation, &operation_arguments,
+                                      &result[1]);
+
+        size_t read_length = operation_arguments.read_length;
+
+        if (success) {
+            result[0] = BINARY_STATUS_OK;
+        } else if (operation_arguments.pec && i2c_pec_error()) {
+            result[0] = BINARY_STATUS_PEC_ERROR;
+            read_length = 0;
+        } else {
+            result[0] = BINARY_STATUS_ERROR;
+            read_length = 0;
+        }
+
+        if (binary_mode) {
+            length += 1 + read_length;
+        } else {
+            send_batch_result(result[0], &result[1], read_length);
+        }
+
+        if (!success && stop) {
+            break;
+        }
+    }
+
+    // Results and statuses are mixed, they are left unencoded
+    if (binary_mode) {
+        send_frame(BINARY_STATUS_OK, batch_results, length);
+        return;
+    }
+
+    response_append_string("\r\n");
+    response_flush();
+}
+
+#endif
+
+static void command_binary(const struct shell_command *command,
+                           const struct shell_arguments *arguments)
+{
+    (void)command;
+    (void)arguments;
+
+    send_ok();
+    binary_mode = true;
+}
+
+static void command_text(const struct shell_command *command,
+                         const struct shell_arguments *arguments)
+{
+    (void)command;
+    (void)arguments;
+
+    send_ok();
+    binary_mode = false;
+}
+
+#if FEATURE_SCAN
+
+#define FIRST_SCAN_ADDRESS 0x08
+#define LAST_SCAN_ADDRESS 0x77
+
+static void command_scan(const struct shell_command *command,
+                         const struct shell_arguments *arguments)
+{
+    (void)command;
+    (void)arguments;
+
+    uint8_t bitmap[16] = {0};
+
+    for (uint8_t address = FIRST_SCAN_ADDRESS;
+         address <= LAST_SCAN_ADDRESS;
+         address++) {
+        bool present;
+
+        // Give up on a stuck bus instead of timing out on every address
+        if (!i2c_probe(address, &present)) {
+            send_error();
+            return;
+        }
+
+        if (present) {
+            bitmap[address / 8] |= 1 << (address % 8);
+        }
+    }
+
+    send_data(bitmap, sizeof(bitmap));
+}
+
+#endif
+
+#if FEATURE_JOBS
+
+#define MAX_JOBS 4
+#define MAX_WATCH_LENGTH 8
+
+enum
+{
+    WATCH_STATE_NONE,
+    WATCH_STATE_VALID,
+    WATCH_STATE_FAILED
+};
+
+struct shell_job
+{
+    bool active;
+    bool tagged;
+    bool watch;
+    uint8_t watch_state;
+    uint16_t tag;
+    uint8_t address;
+    uint8_t write_length;
+    uint8_t read_length;
+    uint8_t write_data[MAX_REGISTER_LENGTH];
+    uint8_t watch_mask[MAX_WATCH_LENGTH];
+    // Last data reported, also kept by short SAMPLE jobs for delta encoding
+    uint8_t watch_data[MAX_WATCH_LENGTH];
+    TickType_t period;
+    TickType_t due;
+};
+
+static struct shell_job jobs[MAX_JOBS];
+
+static void send_event(uint8_t status,
+                       const char *name,
+                       size_t slot,
+                       TickType_t timestamp,
+                       const uint8_t *data,
+                       const uint8_t *previous,
+                       size_t length)
+{
+#if FEATURE_COMPRESSION
+    if (data && compression) {
+        length = encode_data(data, previous, length);
+        data = encode_buffer;
+    }
+#else
+    (void)previous;
+#endif
+
+    if (!data) {
+        length = 0;
+    }
+
+    if (binary_mode) {
+        uint8_t header[5] = {(uint8_t)slot,
+                             (uint8_t)timestamp,
+                             (uint8_t)(timestamp >> 8),
+                             (uint8_t)(timestamp >> 16),
+                             (uint8_t)(timestamp >> 24)};
+        send_frame_header(status, sizeof(header) + length);
+        response_append(header, sizeof(header));
+        response_append(data, length);
+        response_flush();
+        return;
+    }
+
+    uint8_t header[5] = {(uint8_t)slot,
+                         (uint8_t)(timestamp >> 24),
+                         (uint8_t)(timestamp >> 16),
+                         (uint8_t)(timestamp >> 8),
+                         (uint8_t)timestamp};
+
+    send_tag();
+    response_append_string(name);
+    response_append_string(" ");
+    response_append_hex(&header[0], 1);
+    response_append_string(" ");
+    response_append_hex(&header[1], 4);
+    response_append_string(" ");
+
+    if (data) {
+        response_append_hex(data, length);
+    } else {
+        response_append_string("ERROR");
+    }
+
+    response_append_string("\r\n");
+    response_flush();
+}
+
+static bool watch_changed(struct shell_job *job, const uint8_t *data)
+{
+    if (!data) {
+        bool changed = (job->watch_state != WATCH_STATE_FAILED);
+        job->watch_state = WATCH_STATE_FAILED;
+        return changed;
+    }
+
+    bool changed = (job->watch_state != WATCH_STATE_VALID);
+
+    for (size_t position = 0; position < job->read_length; position++) {
+        uint8_t difference = data[position] ^ job->watch_data[position];
+
+        if ((difference & job->watch_mask[position]) != 0) {
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        memcpy(job->watch_data, data, job->read_length);
+    }
+
+    job->watch_state = WATCH_STATE_VALID;
+
+    return changed;
+}
+
+static void shell_run_job(size_t slot)
+{
+    struct shell_job *job = &jobs[slot];
+    uint8_t data[MAX_DATA_LENGTH];
+
+    TickType_t timestamp = xTaskGetTickCount();
+
+    bool success = i2c_write_read(job->address,
+                                  job->write_data, job->write_length,
+                                  data, job->read_length);
+
+    bool saved_tagged = tagged;
+    uint16_t saved_tag = tag;
+
+    tagged = job->tagged;
+    tag = job->tag;
+
+    const uint8_t *result = success ? data : NULL;
+
+    uint8_t previous[MAX_WATCH_LENGTH];
+    bool delta = (job->watch_state == WATCH_STATE_VALID) &&
+                 (job->read_length <= MAX_WATCH_LENGTH);
+
+    if (delta) {
+        memcpy(previous, job->watch_data, job->read_length);
+    }
+
+    if (!job->watch) {
+        if (job->read_length <= MAX_WATCH_LENGTH) {
+            job->watch_state = result ? WATCH_STATE_VALID : WATCH_STATE_FAILED;
+
+            if (result) {
+                memcpy(job->watch_data, result, job->read_length);
+            }
+        }
+
+        send_event(BINARY_STATUS_SAMPLE, "SAMPLE",
+                   slot, timestamp,
+                   result, delta ? previous : NULL, job->read_length);
+    } else if (watch_changed(job, result)) {
+        send_event(BINARY_STATUS_WATCH, "WATCH",
+                   slot, timestamp,
+                   result, delta ? previous : NULL, job->read_length);
+    }
+
+    tagged = saved_tagged;
+    tag = saved_tag;
+}
+
+// Runs every job that is due and returns the ticks until the next one
+static TickType_t shell_run_jobs(void)
+{
+    TickType_t timeout = portMAX_DELAY;
+
+    for (size_t slot = 0; slot < MAX_JOBS; slot++) {
+        struct shell_job *job = &jobs[slot];
+
+        if (!job->active) {
+            continue;
+        }
+
+        TickType_t now = xTaskGetTickCount();
+
+        if ((int32_t)(job->due - now) <= 0) {
+            // The bus is free once the pending transfer has ended
+            shell_finish_transfers();
+            shell_run_job(slot);
+
+            // Keep the sampling grid, but skip samples that were missed
+            job->due += job->period;
+
+            now = xTaskGetTickCount();
+            if ((int32_t)(job->due - now) <= 0) {
+                job->due = now + job->period;
+            }
+        }
+
+        if (job->due - now < timeout) {
+            timeout = job->due - now;
+        }
+    }
+
+    return timeout;
+}
+
+static struct shell_job *shell_add_job(const struct shell_arguments *arguments)
+{
+    if ((arguments->write_lengths[0] > MAX_REGISTER_LENGTH) ||
+        (arguments->read_length > MAX_DATA_LENGTH) ||
+        (arguments->number == 0)) {
+        return NULL;
+    }
+
+    for (size_t slot = 0; slot < MAX_JOBS; slot++) {
+        struct shell_job *job = &jobs[slot];
+
+        if (job->active) {
+            continue;
+        }
+
+        job->tagged = tagged;
+        job->tag = tag;
+        job->watch = false;
+        job->watch_state = WATCH_STATE_NONE;
+        job->address = arguments->address;
+        job->write_length = (uint8_t)arguments->write_lengths[0];
+        job->read_length = (uint8_t)arguments->read_length;
+        memcpy(job->write_data, arguments->write_data[0], job->write_length);
+        job->period = pdMS_TO_TICKS(arguments->number);
+        job->due = xTaskGetTickCount();
+
+        return job;
+    }
+
+    return NULL;
+}
+
+static void send_job_slot(const struct shell_job *job)
+{
+    uint8_t slot = (uint8_t)(job - jobs);
+    send_data(&slot, 1);
+}
+
+static void command_sample(const struct shell_command *command,
+                           const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    struct shell_job *job = shell_add_job(arguments);
+    if (!job) {
+        send_error();
+        return;
+    }
+
+    job->active = true;
+
+    send_job_slot(job);
+}
+
+static void command_watch(const struct shell_command *command,
+                          const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    const uint8_t *mask = NULL;
+
+    if ((arguments->read_length > MAX_WATCH_LENGTH) ||
+        (!arguments_end() &&
+         !decode_data(arguments->read_length, &mask)) ||
+        !arguments_end()) {
+        send_error();
+        return;
+    }
+
+    struct shell_job *job = shell_add_job(arguments);
+    if (!job) {
+        send_error();
+        return;
+    }
+
+    if (mask) {
+        memcpy(job->watch_mask, mask, job->read_length);
+    } else {
+        memset(job->watch_mask, 0xff, job->read_length);
+    }
+
+    job->watch = true;
+    job->active = true;
+
+    send_job_slot(job);
+}
+
+static void command_cancel(const struct shell_command *command,
+                           const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    if ((arguments->number >= MAX_JOBS) || !jobs[arguments->number].active) {
+        send_error();
+        return;
+    }
+
+    jobs[arguments->number].active = false;
+
+    send_ok();
+}
+
+#endif
+
+#if FEATURE_EEPROM
+
+#define EEPROM_WRITE_TIMEOUT 20
+
+// One byte addresses take the upper address bits from the device address
+#define MAX_SHORT_EEPROM_ADDRESS 0x7ff
+#define MAX_EEPROM_ADDRESS UINT16_MAX
+
+static struct
+{
+    bool active;
+    uint8_t address;
+    uint8_t address_width;
+    uint16_t page_size;
+    uint32_t memory_address;
+} eeprom;
+
+// Hex like the other addresses, one to four digits, or 16 bits in a frame
+static bool decode_memory_address(uint16_t *memory_address)
+{
+    if (binary_mode) {
+        return next_u16(memory_address);
+    }
+
+    const char *token = next_token();
+    if (!token) {
+        return false;
+    }
+
+    size_t length = strlen(token);
+    if ((length == 0) || (length > 4)) {
+        return false;
+    }
+
+    char digits[5] = "0000";
+    memcpy(&digits[4 - length], token, length);
+
+    uint8_t bytes[2];
+    if (!read_hex(digits, bytes, sizeof(bytes))) {
+        return false;
+    }
+
+    *memory_address = (uint16_t)((bytes[0] << 8) | bytes[1]);
+
+    return true;
+}
+
+// EEPROM <address> <address width> <memory address> <page size> starts a
+// session that EEPROM_WRITE appends to
+static void command_eeprom(const struct shell_command *command,
+                           const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    uint16_t address_width;
+    uint16_t memory_address;
+    uint16_t page_size;
+
+    eeprom.active = false;
+
+    if (!decode_number(&address_width) ||
+        !decode_memory_address(&memory_address) ||
+        !decode_number(&page_size) ||
+        !arguments_end()) {
+        send_error();
+        return;
+    }
+
+    if (((address_width != 1) && (address_width != 2)) ||
+        ((address_width == 1) &&
+         (memory_address > MAX_SHORT_EEPROM_ADDRESS)) ||
+        (page_size == 0)) {
+        send_error();
+        return;
+    }
+
+    eeprom.active = true;
+    eeprom.address = arguments->address;
+    eeprom.address_width = (uint8_t)address_width;
+    eeprom.page_size = page_size;
+    eeprom.memory_address = memory_address;
+
+    send_ok();
+}
+
+// Writes page by page, waiting for the write cycle to end after each one
+static bool eeprom_write(const uint8_t *data, size_t length)
+{
+    uint32_t limit = MAX_EEPROM_ADDRESS;
+
+    if (eeprom.address_width == 1) {
+        limit = MAX_SHORT_EEPROM_ADDRESS;
+    }
+
+    if (eeprom.memory_address + length > limit + 1) {
+        return false;
+    }
+
+    // The memory address and the data go out as one write, a repeated
+    // START in between would make the data another memory address
+    static uint8_t buffer[2 + MAX_DATA_LENGTH];
+
+    while (length > 0) {
+        size_t chunk = eeprom.page_size -
+                       eeprom.memory_address % eeprom.page_size;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        uint8_t address = eeprom.address;
+        size_t header_length;
+
+        if (eeprom.address_width == 2) {
+            buffer[0] = (uint8_t)(eeprom.memory_address >> 8);
+            buffer[1] = (uint8_t)eeprom.memory_address;
+            header_length = 2;
+        } else {
+            address += (uint8_t)(eeprom.memory_address >> 8);
+            buffer[0] = (uint8_t)eeprom.memory_address;
+            header_length = 1;
+        }
+
+        memcpy(&buffer[header_length], data, chunk);
+
+        if ((address > 0x7f) ||
+            !i2c_write(address, buffer, header_length + chunk) ||
+            !i2c_poll(address, EEPROM_WRITE_TIMEOUT)) {
+            return false;
+        }
+
+        eeprom.memory_address += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+
+    return true;
+}
+
+static void command_eeprom_write(const struct shell_command *command,
+                                 const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    // A failed write ends the session, the host has to start over
+    if (!eeprom.active ||
+        !eeprom_write(arguments->write_data[0], arguments->write_lengths[0])) {
+        eeprom.active = false;
+        send_error();
+        return;
+    }
+
+    send_ok();
+}
+
+#endif
+
+#if FEATURE_BUS_SPEED
+
+// Optional rise and fall times in nanoseconds follow the frequency in kHz
+static bool decode_edge_times(uint16_t *rise_time, uint16_t *fall_time)
+{
+    *rise_time = DEFAULT_RISE_TIME;
+    *fall_time = DEFAULT_FALL_TIME;
+
+    if (!arguments_end() &&
+        (!decode_number(rise_time) || !decode_number(fall_time))) {
+        return false;
+    }
+
+    return arguments_end();
+}
+
+static void send_frequency(uint32_t frequency)
+{
+    uint8_t data[4] = {(uint8_t)frequency,
+                       (uint8_t)(frequency >> 8),
+                       (uint8_t)(frequency >> 16),
+                       (uint8_t)(frequency >> 24)};
+    send_data(data, sizeof(data));
+}
+
+static void command_speed(const struct shell_command *command,
+                          const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    uint16_t rise_time;
+    uint16_t fall_time;
+    uint32_t achieved;
+
+    if (!decode_edge_times(&rise_time, &fall_time) ||
+        !i2c_set_frequency((uint32_t)arguments->number * 1000,
+                           rise_time, fall_time, &achieved)) {
+        send_error();
+        return;
+    }
+
+    send_frequency(achieved);
+}
+
+static void command_profile(const struct shell_command *command,
+                            const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    uint16_t rise_time;
+    uint16_t fall_time;
+    uint32_t achieved;
+
+    if (!decode_edge_times(&rise_time, &fall_time) ||
+        !i2c_set_address_frequency(arguments->address,
+                                   (uint32_t)arguments->number * 1000,
+                                   rise_time, fall_time, &achieved)) {
+        send_error();
+        return;
+    }
+
+    send_frequency(achieved);
+}
+
+#endif
+
+static void command_timeout(const struct shell_command *command,
+                            const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    if (!i2c_set_timeout(arguments->number)) {
+        send_error();
+        return;
+    }
+
+    send_ok();
+}
+
+#if FEATURE_RECOVERY
+
+static void command_busreset(const struct shell_command *command,
+                             const struct shell_arguments *arguments)
+{
+    (void)command;
+    (void)arguments;
+
+    if (!i2c_recover()) {
+        send_error();
+        return;
+    }
+
+    send_ok();
+}
+
+#endif
+
+#if FEATURE_SMBUS
+
+// The request is written from the same buffer before the block is read
+static uint8_t block_buffer[MAX_DATA_LENGTH + 1];
+
+static void command_block(const struct shell_command *command,
+                          const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    size_t length = arguments->write_lengths[0];
+
+    memcpy(block_buffer, arguments->write_data[0], length);
+
+    if (arguments->write_count == 2) {
+        size_t block_length = arguments->write_lengths[1];
+
+        if (length + 1 + block_length > sizeof(block_buffer)) {
+            send_error();
+            return;
+        }
+
+        block_buffer[length++] = (uint8_t)block_length;
+        memcpy(&block_buffer[length], arguments->write_data[1], block_length);
+        length += block_length;
+    }
+
+    i2c_set_pec(arguments->pec);
+
+    bool success = i2c_write_block_read(arguments->address,
+                                        block_buffer, length,
+                                        block_buffer, sizeof(block_buffer));
+    bool pec_error = arguments->pec && !success && i2c_pec_error();
+
+    i2c_set_pec(false);
+
+    if (!success) {
+        send_transfer_error(pec_error);
+        return;
+    }
+
+    send_data(&block_buffer[1], block_buffer[0]);
+}
+
+#endif
+
+#if FEATURE_COMPRESSION
+
+static void command_compress(const struct shell_command *command,
+                             const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    if (arguments->number > 1) {
+        send_error();
+        return;
+    }
+
+    compression = (arguments->number != 0);
+    previous_read.valid = false;
+
+    send_ok();
+}
+
+#endif
+
+#if FEATURE_MACROS
+
+#define BOOT_MACRO_ID 0
+#define MAX_MACRO_LINE_LENGTH 127
+
+static bool macro_running = false;
+static bool macro_pending = false;
+static uint8_t macro_pending_id;
+static bool macro_recording = false;
+static uint8_t macro_recording_id;
+
+// A line being run or checked for MACRO_END, which tokenizing cuts up
+static char macro_line[MAX_MACRO_LINE_LENGTH + 1];
+
+static void shell_process_command(char *command);
+
+static bool shell_run_macro_line(const char *line, size_t length)
+{
+    if (length > MAX_MACRO_LINE_LENGTH) {
+        return false;
+    }
+
+    memcpy(macro_line, line, length);
+    macro_line[length] = '\0';
+
+    binary_mode = false;
+    response_failed = false;
+
+    shell_process_command(macro_line);
+
+    return !response_failed;
+}
+
+// Runs a macro with the answers of its commands suppressed
+static bool shell_run_macro(uint8_t id)
+{
+    const uint8_t *record = macro_find(id);
+
+    if (!record) {
+        return false;
+    }
+
+    bool saved_binary_mode = binary_mode;
+    bool saved_tagged = tagged;
+    uint16_t saved_tag = tag;
+
+    macro_running = true;
+    response_muted = true;
+
+    bool success = true;
+
+    while (success) {
+        size_t length;
+        const char *line = macro_next_line(id, &record, &length);
+
+        if (!line) {
+            break;
+        }
+
+        success = shell_run_macro_line(line, length);
+    }
+
+    response_muted = false;
+    macro_running = false;
+
+    binary_mode = saved_binary_mode;
+    tagged = saved_tagged;
+    tag = saved_tag;
+
+    return success;
+}
+
+// Tokenized like any command, so spaces or a tag do not hide MACRO_END
+static bool shell_is_macro_end(const char *line, size_t length)
+{
+    memcpy(macro_line, line, length + 1);
+
+    if (!decode_tag(macro_line)) {
+        return false;
+    }
+
+    const char *name = next_token();
+
+    return name && (strcmp(name, "MACRO_END") == 0) && arguments_end();
+}
+
+static void shell_record_line(const char *line)
+{
+    size_t length = strlen(line);
+
+    if ((length <= MAX_MACRO_LINE_LENGTH) &&
+        shell_is_macro_end(line, length)) {
+        macro_recording = false;
+
+        if (!macro_end(macro_recording_id)) {
+            send_error();
+            return;
+        }
+
+        send_ok();
+        return;
+    }
+
+    tagged = false;
+
+    if ((length > MAX_MACRO_LINE_LENGTH) ||
+        !macro_append(macro_recording_id, line, length)) {
+        macro_recording = false;
+        send_error();
+        return;
+    }
+
+    send_ok();
+}
+
+static void command_macro(const struct shell_command *command,
+                          const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    if (macro_running || (arguments->number > MAX_MACRO_ID)) {
+        send_error();
+        return;
+    }
+
+    // Run by the shell task once this command has been dispatched
+    macro_pending = true;
+    macro_pending_id = (uint8_t)arguments->number;
+}
+
+// Runs a macro outside of any command dispatch, which keeps the stack flat
+static void shell_run_pending_macro(void)
+{
+    if (!macro_pending) {
+        return;
+    }
+
+    macro_pending = false;
+
+    if (!shell_run_macro(macro_pending_id)) {
+        send_error();
+        return;
+    }
+
+    send_ok();
+}
+
+static void command_macro_begin(const struct shell_command *command,
+                                const struct shell_arguments *arguments)
+{
+    (void)command;
+
+    // Macros hold text commands, so they are recorded from text mode only
+    if (binary_mode || macro_running ||
+        (arguments->number > MAX_MACRO_ID)) {
+        send_error();
+        return;
+    }
+
+    if (!macro_begin((uint8_t)arguments->number)) {
+        send_error();
+        return;
+    }
+
+    macro_recording = true;
+    macro_recording_id = (uint8_t)arguments->number;
+
+    send_ok();
+}
+
+static void command_macro_erase(const struct shell_command *command,
+                                const struct shell_arguments *arguments)
+{
+    (void)command;
+    (void)arguments;
+
+    if (macro_running || !macro_erase()) {
+        send_error();
+        return;
+    }
+
+    send_ok();
+}
+
+#endif
+
+// Indexed by binary opcode, the commands left out have no handler
+static const struct shell_command commands[BINARY_OPCODE_COUNT] = {
+    [BINARY_OPCODE_PING] = {
+        "PING", "", NULL, command_ping
+    },
+    [BINARY_OPCODE_READ] = {
+        "READ", "ar", transfer_read, command_transfer
+    },
+    [BINARY_OPCODE_WRITE] = {
+        "WRITE", "aw", transfer_write, command_transfer
+    },
+    [BINARY_OPCODE_WRITE_READ] = {
+        "WRITE_READ", "awr", transfer_write_read, command_transfer
+    },
+    [BINARY_OPCODE_WRITE_WRITE] = {
+        "WRITE_WRITE", "aww", transfer_write_write, command_transfer
+    },
+#if FEATURE_BATCH
+    [BINARY_OPCODE_BATCH] = {
+        "BATCH", "*", NULL, command_batch
+    },
+#endif
+    [BINARY_OPCODE_BINARY] = {
+        "BINARY", "", NULL, command_binary
+    },
+    [BINARY_OPCODE_TEXT] = {
+        "TEXT", "", NULL, command_text
+    },
+#if FEATURE_JOBS
+    [BINARY_OPCODE_SAMPLE] = {
+        "SAMPLE", "awrn", NULL, command_sample
+    },
+    [BINARY_OPCODE_CANCEL] = {
+        "CANCEL", "n", NULL, command_cancel
+    },
+    [BINARY_OPCODE_WATCH] = {
+        "WATCH", "awrn*", NULL, command_watch
+    },
+#endif
+#if FEATURE_SCAN
+    [BINARY_OPCODE_SCAN] = {
+        "SCAN", "", NULL, command_scan
+    },
+#endif
+#if FEATURE_MACROS
+    [BINARY_OPCODE_MACRO] = {
+        "MACRO", "n", NULL, command_macro
+    },
+    [BINARY_OPCODE_MACRO_BEGIN] = {
+        "MACRO_BEGIN", "n", NULL, command_macro_begin
+    },
+    [BINARY_OPCODE_MACRO_ERASE] = {
+        "MACRO_ERASE", "", NULL, command_macro_erase
+    },
+#endif
+#if FEATURE_COMPRESSION
+    [BINARY_OPCODE_COMPRESS] = {
+        "COMPRESS", "n", NULL, command_compress
+    },
+#endif
+#if FEATURE_EEPROM
+    [BINARY_OPCODE_POLL] = {
+        "POLL", "an", transfer_poll, command_transfer
+    },
+    [BINARY_OPCODE_EEPROM] = {
+        "EEPROM", "a*", NULL, command_eeprom
+    },
+    [BINARY_OPCODE_EEPROM_WRITE] = {
+        "EEPROM_WRITE", "w", NULL, command_eeprom_write
+    },
+#endif
+#if FEATURE_BUS_SPEED
+    [BINARY_OPCODE_SPEED] = {
+        "SPEED", "n*", NULL, command_speed
+    },
+    [BINARY_OPCODE_PROFILE] = {
+        "PROFILE", "an*", NULL, command_profile
+    },
+#endif
+    [BINARY_OPCODE_TIMEOUT] = {
+        "TIMEOUT", "n", NULL, command_timeout
+    },
+#if FEATURE_RECOVERY
+    [BINARY_OPCODE_BUSRESET] = {
+        "BUSRESET", "", NULL, command_busreset
+    },
+#endif
+#if FEATURE_SMBUS
+    [BINARY_OPCODE_READ_PEC] = {
+        "READ_PEC", "arp", transfer_read, command_transfer
+    },
+    [BINARY_OPCODE_WRITE_PEC] = {
+        "WRITE_PEC", "awp", transfer_write, command_transfer
+    },
+    [BINARY_OPCODE_WRITE_READ_PEC] = {
+        "WRITE_READ_PEC", "awrp", transfer_write_read, command_transfer
+    },
+    [BINARY_OPCODE_BLOCK_READ] = {
+        "BLOCK_READ", "aw", NULL, command_block
+    },
+    [BINARY_OPCODE_BLOCK_PROCESS_CALL] = {
+        "BLOCK_PROCESS_CALL", "aww", NULL, command_block
+    },
+    [BINARY_OPCODE_BLOCK_READ_PEC] = {
+        "BLOCK_READ_PEC", "awp", NULL, command_block
+    },
+    [BINARY_OPCODE_BLOCK_PROCESS_CALL_PEC] = {
+        "BLOCK_PROCESS_CALL_PEC", "awwp", NULL, command_block
+    }
+#endif
+};
+
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+#define OPCODE_LIST_END 0xff
+
+// Opcodes of the commands by first letter, a lookup compares only a few names
+static const uint8_t *const commands_by_letter['Z' - 'A' + 1] = {
+    ['B' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_BATCH, BINARY_OPCODE_BINARY, BINARY_OPCODE_BUSRESET,
+        BINARY_OPCODE_BLOCK_READ, BINARY_OPCODE_BLOCK_PROCESS_CALL,
+        BINARY_OPCODE_BLOCK_READ_PEC, BINARY_OPCODE_BLOCK_PROCESS_CALL_PEC,
+        OPCODE_LIST_END
+    },
+    ['C' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_CANCEL, BINARY_OPCODE_COMPRESS, OPCODE_LIST_END
+    },
+    ['E' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_EEPROM, BINARY_OPCODE_EEPROM_WRITE, OPCODE_LIST_END
+    },
+    ['M' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_MACRO, BINARY_OPCODE_MACRO_BEGIN,
+        BINARY_OPCODE_MACRO_ERASE, OPCODE_LIST_END
+    },
+    ['P' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_PING, BINARY_OPCODE_POLL, BINARY_OPCODE_PROFILE,
+        OPCODE_LIST_END
+    },
+    ['R' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_READ, BINARY_OPCODE_READ_PEC, OPCODE_LIST_END
+    },
+    ['S' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_SAMPLE, BINARY_OPCODE_SCAN, BINARY_OPCODE_SPEED,
+        OPCODE_LIST_END
+    },
+    ['T' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_TEXT, BINARY_OPCODE_TIMEOUT, OPCODE_LIST_END
+    },
+    ['W' - 'A'] = (const uint8_t[]){
+        BINARY_OPCODE_WRITE, BINARY_OPCODE_WRITE_READ,
+        BINARY_OPCODE_WRITE_WRITE, BINARY_OPCODE_WATCH,
+        BINARY_OPCODE_WRITE_PEC, BINARY_OPCODE_WRITE_READ_PEC,
+        OPCODE_LIST_END
+    }
+};
+
+static const struct shell_command *find_command_by_name(const char *name)
+{
+    if ((name[0] < 'A') || (name[0] > 'Z')) {
+        return NULL;
+    }
+
+    const uint8_t *opcode = commands_by_letter[name[0] - 'A'];
+
+    if (!opcode) {
+        return NULL;
+    }
+
+    for (; *opcode != OPCODE_LIST_END; opcode++) {
+        if (commands[*opcode].name &&
+            (strcmp(commands[*opcode].name, name) == 0)) {
+            return &commands[*opcode];
+        }
+    }
+
+    return NULL;
+}
+
+static const struct shell_command *find_command_by_opcode(uint8_t opcode)
+{
+    if ((opcode >= COMMAND_COUNT) || !commands[opcode].handler) {
+        return NULL;
+    }
+
+    return &commands[opcode];
+}
+
+static const struct shell_command *decode_command(void)
+{
+    if (binary_mode) {
+        uint8_t opcode;
+
+        if (!next_byte(&opcode)) {
+            return NULL;
+        }
+
+        return find_command_by_opcode(opcode);
+    }
+
+    const char *name = next_token();
+    if (!name) {
+        return NULL;
+    }
+
+    return find_command_by_name(name);
+}
+
+#if FEATURE_PIPELINE
+
+// Whether a tagged command may be answered ahead of a pending transfer
+static bool shell_overtakes(const struct shell_command *command)
+{
+    if (!tagged || response_muted) {
+        return false;
+    }
+
+#if FEATURE_JOBS
+    if ((command->handler == command_sample) ||
+        (command->handler == command_watch) ||
+        (command->handler == command_cancel)) {
+        return true;
+    }
+#endif
+
+    return command->handler == command_ping;
+}
+
+#endif
+
+static void shell_dispatch(const struct shell_command *command)
+{
+    struct shell_arguments arguments;
+
+    if (!command || !decode_arguments(command, &arguments) ||
+        (!strchr(command->schema, '*') && !arguments_end())) {
+        shell_finish_transfers();
+        send_error();
+        return;
+    }
+
+#if FEATURE_PIPELINE
+    // Plain transfers run on the bus while the next command is parsed,
+    // those of a macro are muted and have to fail before the next line
+    if (command->transfer && !response_muted &&
+        shell_submit_transfer(command, &arguments)) {
+        return;
+    }
+
+    if (shell_overtakes(command)) {
+        command->handler(command, &arguments);
+        return;
+    }
+#endif
+
+    shell_finish_transfers();
+
+    command->handler(command, &arguments);
+}
+
+static void shell_process_command(char *command)
+{
+    if (!decode_tag(command)) {
+        shell_finish_transfers();
+        send_error();
+        return;
+    }
+
+    shell_dispatch(decode_command());
+}
+
+static void shell_process_frame(const uint8_t *frame, size_t frame_length)
+{
+    tagged = false;
+
+    frame_position = frame;
+    frame_end = frame + frame_length;
+
+    uint8_t opcode;
+    if (!next_byte(&opcode)) {
+        shell_finish_transfers();
+        send_error();
+        return;
+    }
+
+    if ((opcode & BINARY_FLAG_TAGGED) != 0) {
+        if (!next_u16(&tag)) {
+            shell_finish_transfers();
+            send_error();
+            return;
+        }
+
+        tagged = true;
+    }
+
+    shell_dispatch(find_command_by_opcode(opcode & BINARY_OPCODE_MASK));
+}
+
+bool is_character(uint8_t byte)
+{
+    return (byte >= ' ') && (byte <= '~');
+}
+
+#define MAX_COMMAND_LENGTH 511
+
+static void filter_command(char *command)
+{
+    char *target = command;
+
+    for (const char *source = command; *source != '\0'; source++) {
+        if (is_character((uint8_t)*source)) {
+            *target++ = *source;
+        }
+    }
+
+    *target = '\0';
+}
+
+noreturn static void shell_task(void *parameter)
+{
+    (void)parameter;
+
+    static uint8_t command_buffer[MAX_COMMAND_LENGTH + 1];
+    size_t buffer_length = 0;
+    size_t scanned_length = 0;
+    bool carriage_return = false;
+    bool filter = false;
+    bool overflow = false;
+
+#if FEATURE_MACROS
+    shell_run_macro(BOOT_MACRO_ID);
+#endif
+
+    for (;;) {
+#if FEATURE_JOBS
+        TickType_t timeout = shell_run_jobs();
+#else
+        TickType_t timeout = portMAX_DELAY;
+#endif
+
+        // Only look for more commands while a transfer is pending
+        if (transfer_pending) {
+            timeout = 0;
+        }
+
+        size_t received = usb_recv_timeout(&command_buffer[buffer_length],
+                                           MAX_COMMAND_LENGTH - buffer_length,
+                                           timeout);
+
+        // Answer pending transfers once there are no more commands to parse
+        if (received == 0) {
+            shell_finish_transfers();
+        }
+
+        buffer_length += received;
+
+        size_t position = 0;
+
+        while (position < buffer_length) {
+            uint8_t *start = &command_buffer[position];
+            size_t available = buffer_length - position;
+
+            // Swallow the LF of a CRLF that ended the BINARY command
+            if (carriage_return) {
+                carriage_return = false;
+
+                if (*start == '\n') {
+                    position++;
+                    continue;
+                }
+            }
+
+            if (binary_mode) {
+                if (available - 1 < start[0]) {
+                    break;
+                }
+
+                shell_process_frame(&start[1], start[0]);
+#if FEATURE_MACROS
+                shell_run_pending_macro();
+#endif
+                position += 1 + start[0];
+                continue;
+            }
+
+            size_t length = scanned_length;
+
+            while ((length < available) &&
+                   (start[length] != '\n') && (start[length] != '\r')) {
+                filter |= !is_character(start[length]);
+                length++;
+            }
+
+            if (length == available) {
+                scanned_length = length;
+                break;
+            }
+
+            carriage_return = (start[length] == '\r');
+            start[length] = '\0';
+
+            if (overflow) {
+                // The tag of an overlong line was never parsed
+                tagged = false;
+
+                shell_finish_transfers();
+                send_error();
+            } else if (length != 0) {
+                if (filter) {
+                    filter_command((char *)start);
+                }
+
+                if (*start == '\0') {
+                    // Nothing left after filtering
+#if FEATURE_MACROS
+                } else if (macro_recording) {
+                    shell_record_line((const char *)start);
+#endif
+                } else {
+                    shell_process_command((char *)start);
+#if FEATURE_MACROS
+                    shell_run_pending_macro();
+#endif
+                }
+            }
+
+            position += length + 1;
+            scanned_length = 0;
+            filter = false;
+            overflow = false;
+        }
+
+        buffer_length -= position;
+        memmove(command_buffer, &command_buffer[position], buffer_length);
+
+        // Drop the overlong line and report it once it is terminated
+        if (buffer_length == MAX_COMMAND_LENGTH) {
+            buffer_length = 0;
+            scanned_length = 0;
+            overflow = true;
         }
     }
 }
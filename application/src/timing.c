@@ -0,0 +1,130 @@
+#include "timing.h"
+
+#include <stddef.h>
+
+#include <libopencm3/stm32/i2c.h>
+
+#define MAX_PRESC 15
+
+// The register fields hold these counts minus one
+#define MAX_SCL_CYCLES 256
+#define MAX_SCLDEL_CYCLES 16
+
+#define MAX_SDADEL 15
+
+// Delay from an SCL edge on the pin to the peripheral seeing it
+#define SYNC_CYCLES 3
+#define ANALOG_FILTER_DELAY 50
+
+struct bus_mode
+{
+    uint32_t max_frequency;
+    uint16_t min_low;
+    uint16_t min_high;
+    uint16_t min_setup;
+};
+
+// Minimum SCL low, SCL high and data setup times in nanoseconds
+static const struct bus_mode bus_modes[] = {
+    {100000, 4700, 4000, 250},
+    {400000, 1300, 600, 100},
+    {1000000, 500, 260, 50}
+};
+
+#define BUS_MODE_COUNT (sizeof(bus_modes) / sizeof(bus_modes[0]))
+
+static uint32_t divide_up(uint32_t value, uint32_t divisor)
+{
+    return (value + divisor - 1) / divisor;
+}
+
+static uint32_t ns_to_cycles(uint32_t clock_mhz, uint32_t time)
+{
+    return divide_up(time * clock_mhz, 1000);
+}
+
+bool timing_compute(uint32_t clock,
+                    uint32_t frequency,
+                    uint32_t rise_time,
+                    uint32_t fall_time,
+                    uint32_t *timing,
+                    uint32_t *achieved)
+{
+    const struct bus_mode *mode = NULL;
+
+    for (size_t index = 0; index < BUS_MODE_COUNT; index++) {
+        if (frequency <= bus_modes[index].max_frequency) {
+            mode = &bus_modes[index];
+            break;
+        }
+    }
+
+    if ((frequency == 0) || !mode) {
+        return false;
+    }
+
+    uint32_t clock_mhz = clock / 1000000;
+
+    uint32_t rise = ns_to_cycles(clock_mhz, rise_time);
+    uint32_t fall = ns_to_cycles(clock_mhz, fall_time);
+    uint32_t filter = ns_to_cycles(clock_mhz, ANALOG_FILTER_DELAY);
+
+    // Each SCL phase lasts its count plus the time to see the edge starting it
+    uint32_t low_overhead = fall + filter + SYNC_CYCLES;
+    uint32_t high_overhead = rise + filter + SYNC_CYCLES;
+    uint32_t overhead = low_overhead + high_overhead;
+
+    // Round the period up so that the bus never runs faster than asked
+    uint32_t period = divide_up(clock, frequency);
+
+    if ((period <= overhead) ||
+        (period - overhead > (MAX_PRESC + 1) * MAX_SCL_CYCLES * 2)) {
+        return false;
+    }
+
+    // Split the period in the ratio of the minimum low and high times
+    uint32_t low = period * mode->min_low / (mode->min_low + mode->min_high);
+    uint32_t min_low = ns_to_cycles(clock_mhz, mode->min_low);
+    if (low < min_low) {
+        low = min_low;
+    }
+
+    uint32_t high = (period > low) ? period - low : 0;
+    uint32_t min_high = ns_to_cycles(clock_mhz, mode->min_high);
+    if (high < min_high) {
+        high = min_high;
+    }
+
+    // The counters only run once the edge starting their phase is seen
+    low = (low > low_overhead) ? low - low_overhead : 1;
+    high = (high > high_overhead) ? high - high_overhead : 1;
+
+    uint32_t setup = rise + ns_to_cycles(clock_mhz, mode->min_setup);
+
+    // The finest prescaler that fits gives the closest frequency
+    for (uint32_t presc = 0; presc <= MAX_PRESC; presc++) {
+        uint32_t unit = presc + 1;
+
+        uint32_t scll = divide_up(low, unit);
+        uint32_t sclh = divide_up(high, unit);
+        uint32_t sdadel = divide_up(fall, unit);
+        uint32_t scldel = divide_up(setup, unit);
+
+        if ((scll > MAX_SCL_CYCLES) || (sclh > MAX_SCL_CYCLES) ||
+            (sdadel > MAX_SDADEL) || (scldel > MAX_SCLDEL_CYCLES)) {
+            continue;
+        }
+
+        *timing = (presc << I2C_TIMINGR_PRESC_SHIFT) |
+                  ((scldel - 1) << I2C_TIMINGR_SCLDEL_SHIFT) |
+                  (sdadel << I2C_TIMINGR_SDADEL_SHIFT) |
+                  ((sclh - 1) << I2C_TIMINGR_SCLH_SHIFT) |
+                  ((scll - 1) << I2C_TIMINGR_SCLL_SHIFT);
+
+        *achieved = clock / ((scll + sclh) * unit + overhead);
+
+        return true;
+    }
+
+    return false;
+}
@@ -6,7 +6,6 @@
 
 #include <FreeRTOS.h>
 #include <task.h>
-#include <stream_buffer.h>
 
 #include <libopencm3/stm32/f0/nvic.h>
 #include <libopencm3/stm32/rcc.h>
@@ -217,11 +216,104 @@ cdc_acm_control_request(usbd_device *device,
     }
 }
 
-#define RECV_BUFFER_STORAGE_SIZE 512
+/*
+ * Byte rings between the USB task and the shell task, each with a single
+ * writer and a single reader. The indices run freely and wrap at the
+ * power of two size, so head - tail is the number of bytes stored.
+ */
 
-static StaticStreamBuffer_t recv_buffer_data;
-static uint8_t recv_buffer_storage[RECV_BUFFER_STORAGE_SIZE];
-static StreamBufferHandle_t recv_buffer;
+#define RING_BUFFER_SIZE 512
+
+struct ring_buffer
+{
+    uint8_t storage[RING_BUFFER_SIZE];
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    // The task blocked on the ring, woken by the other side
+    volatile TaskHandle_t waiting_task;
+};
+
+static size_t ring_buffer_used(const struct ring_buffer *ring)
+{
+    return (uint16_t)(ring->head - ring->tail);
+}
+
+static size_t ring_buffer_write(struct ring_buffer *ring,
+                                const uint8_t *data,
+                                size_t size)
+{
+    size_t space = RING_BUFFER_SIZE - ring_buffer_used(ring);
+    if (size > space) {
+        size = space;
+    }
+
+    size_t start = ring->head % RING_BUFFER_SIZE;
+    size_t first = RING_BUFFER_SIZE - start;
+    if (first > size) {
+        first = size;
+    }
+
+    memcpy(&ring->storage[start], data, first);
+    memcpy(ring->storage, &data[first], size - first);
+
+    // The reader must not see the new head before the bytes
+    atomic_signal_fence(memory_order_release);
+    ring->head += (uint16_t)size;
+
+    return size;
+}
+
+static size_t ring_buffer_read(struct ring_buffer *ring,
+                               uint8_t *data,
+                               size_t size)
+{
+    size_t used = ring_buffer_used(ring);
+    if (size > used) {
+        size = used;
+    }
+
+    atomic_signal_fence(memory_order_acquire);
+
+    size_t start = ring->tail % RING_BUFFER_SIZE;
+    size_t first = RING_BUFFER_SIZE - start;
+    if (first > size) {
+        first = size;
+    }
+
+    memcpy(data, &ring->storage[start], first);
+    memcpy(&data[first], ring->storage, size - first);
+
+    atomic_signal_fence(memory_order_release);
+    ring->tail += (uint16_t)size;
+
+    return size;
+}
+
+// Waits for the other side to move the ring away from the given fill. It
+// is checked again once the task is published, so no wakeup gets lost.
+static void ring_buffer_wait(struct ring_buffer *ring,
+                             size_t used,
+                             TickType_t timeout)
+{
+    ring->waiting_task = xTaskGetCurrentTaskHandle();
+
+    if (ring_buffer_used(ring) == used) {
+        ulTaskNotifyTake(pdTRUE, timeout);
+    }
+
+    ring->waiting_task = NULL;
+}
+
+static void ring_buffer_wake(struct ring_buffer *ring)
+{
+    TaskHandle_t task = ring->waiting_task;
+
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+}
+
+static struct ring_buffer recv_buffer;
 static volatile atomic_bool receiving;
 
 static void cdc_acm_recv_callback(usbd_device *device, uint8_t endpoint)
@@ -235,14 +327,13 @@ static void cdc_acm_recv_callback(usbd_device *device, uint8_t endpoint)
                                         buffer,
                                         sizeof(buffer));
 
+    // The endpoint only takes a packet while the ring has room for it
     if (length > 0) {
-        xStreamBufferSend(recv_buffer,
-                          buffer,
-                          length,
-                          portMAX_DELAY);
+        ring_buffer_write(&recv_buffer, buffer, length);
+        ring_buffer_wake(&recv_buffer);
     }
 
-    size_t available = xStreamBufferSpacesAvailable(recv_buffer);
+    size_t available = RING_BUFFER_SIZE - ring_buffer_used(&recv_buffer);
     if (available >= DATA_OUT_PACKET_SIZE) {
         usbd_ep_nak_set(device, endpoint, 0);
     } else {
@@ -250,11 +341,7 @@ static void cdc_acm_recv_callback(usbd_device *device, uint8_t endpoint)
     }
 }
 
-#define SEND_BUFFER_STORAGE_SIZE 512
-
-static StaticStreamBuffer_t send_buffer_data;
-static uint8_t send_buffer_storage[SEND_BUFFER_STORAGE_SIZE];
-static StreamBufferHandle_t send_buffer;
+static struct ring_buffer send_buffer;
 static volatile atomic_bool sending;
 
 static void cdc_acm_send_callback(usbd_device *device, uint8_t endpoint)
@@ -263,10 +350,8 @@ static void cdc_acm_send_callback(usbd_device *device, uint8_t endpoint)
 
     uint8_t buffer[DATA_IN_PACKET_SIZE];
 
-    size_t length = xStreamBufferReceive(send_buffer,
-                                         buffer,
-                                         sizeof(buffer),
-                                         0);
+    size_t length = ring_buffer_read(&send_buffer, buffer, sizeof(buffer));
+    ring_buffer_wake(&send_buffer);
 
     if (length > 0) {
         sending = true;
@@ -326,12 +411,10 @@ static inline void usb_enable_irq(void)
     *USB_CNTR_REG |= mask;
 }
 
-enum
-{
-    POLL_NOTIFICATION = 0x01,
-    RECV_NOTIFICATION = 0x02,
-    SEND_NOTIFICATION = 0x04
-};
+// Work for the USB task, each flag set before the task is notified
+static volatile bool poll_pending;
+static volatile bool recv_pending;
+static volatile bool send_pending;
 
 static TaskHandle_t task_handle;
 
@@ -343,8 +426,10 @@ void usb_isr(void)
 
     nvic_disable_irq(NVIC_USB_IRQ);
 
-    BaseType_t need_yield;
-    xTaskNotifyFromISR(task_handle, POLL_NOTIFICATION, eSetBits, &need_yield);
+    poll_pending = true;
+
+    BaseType_t need_yield = pdFALSE;
+    vTaskNotifyGiveFromISR(task_handle, &need_yield);
     portYIELD_FROM_ISR(need_yield);
 }
 
@@ -353,14 +438,11 @@ noreturn static void usb_task(void *parameter)
     usbd_device *device = parameter;
 
     for (;;) {
-        uint32_t notification = 0;
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-        xTaskNotifyWait(0,
-                        UINT32_MAX,
-                        &notification,
-                        portMAX_DELAY);
+        if (poll_pending) {
+            poll_pending = false;
 
-        if ((notification & POLL_NOTIFICATION) != 0) {
             while (usb_irq_active()) {
                 usbd_poll(device);
             }
@@ -368,9 +450,12 @@ noreturn static void usb_task(void *parameter)
             nvic_enable_irq(NVIC_USB_IRQ);
         }
 
-        if ((notification & RECV_NOTIFICATION) != 0) {
+        if (recv_pending) {
+            recv_pending = false;
+
             if (!receiving) {
-                size_t available = xStreamBufferSpacesAvailable(recv_buffer);
+                size_t available = RING_BUFFER_SIZE -
+                                   ring_buffer_used(&recv_buffer);
                 if (available >= DATA_OUT_PACKET_SIZE) {
                     receiving = true;
                     usbd_ep_nak_set(device, DATA_OUT_ENDPOINT, 0);
@@ -378,10 +463,11 @@ noreturn static void usb_task(void *parameter)
             }
         }
 
-        if ((notification & SEND_NOTIFICATION) != 0) {
+        if (send_pending) {
+            send_pending = false;
+
             if (!sending) {
-                size_t available = xStreamBufferBytesAvailable(send_buffer);
-                if (available > 0) {
+                if (ring_buffer_used(&send_buffer) > 0) {
                     sending = true;
                     cdc_acm_send_callback(device, DATA_IN_ENDPOINT);
                 }
@@ -420,16 +506,7 @@ void usb_init(void)
                        sizeof(control_buffer));
     usbd_register_set_config_callback(device, cdc_acm_set_config);
 
-    recv_buffer = xStreamBufferCreateStatic(sizeof(recv_buffer_storage) - 1,
-                                            1,
-                                            recv_buffer_storage,
-                                            &recv_buffer_data);
     receiving = true;
-
-    send_buffer = xStreamBufferCreateStatic(sizeof(send_buffer_storage) - 1,
-                                            1,
-                                            send_buffer_storage,
-                                            &send_buffer_data);
     sending = false;
 
     task_handle = xTaskCreateStatic(&usb_task,
@@ -447,13 +524,21 @@ void usb_init(void)
 
 size_t usb_recv(uint8_t *data, size_t size)
 {
-    size_t length = xStreamBufferReceive(recv_buffer,
-                                         data,
-                                         size,
-                                         portMAX_DELAY);
+    return usb_recv_timeout(data, size, portMAX_DELAY);
+}
+
+size_t usb_recv_timeout(uint8_t *data, size_t size, uint32_t timeout)
+{
+    size_t length = ring_buffer_read(&recv_buffer, data, size);
+
+    if ((length == 0) && (timeout != 0)) {
+        ring_buffer_wait(&recv_buffer, 0, timeout);
+        length = ring_buffer_read(&recv_buffer, data, size);
+    }
 
     if (!receiving) {
-        xTaskNotify(task_handle, RECV_NOTIFICATION, eSetBits);
+        recv_pending = true;
+        xTaskNotifyGive(task_handle);
     }
 
     return length;
@@ -461,11 +546,21 @@ size_t usb_recv(uint8_t *data, size_t size)
 
 size_t usb_send(const uint8_t *data, size_t size)
 {
-    size_t length = xStreamBufferSend(send_buffer, data, size, portMAX_DELAY);
+    size_t length = 0;
 
-    if (!sending) {
-        xTaskNotify(task_handle, SEND_NOTIFICATION, eSetBits);
-    }
+    for (;;) {
+        length += ring_buffer_write(&send_buffer, &data[length],
+                                    size - length);
 
-    return length;
+        if (!sending) {
+            send_pending = true;
+            xTaskNotifyGive(task_handle);
+        }
+
+        if (length == size) {
+            return length;
+        }
+
+        ring_buffer_wait(&send_buffer, RING_BUFFER_SIZE, portMAX_DELAY);
+    }
 }
@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 199309L
+
+// The shell is included whole so that its hex codec can be called directly
+#include "../application/src/shell.c"
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Compares the table-driven hex codec of the shell with the nibble at a
+ * time codec it replaced, kept below as it was. The string is placed at
+ * a word aligned and at an odd address, as answers and commands can start
+ * at either. Cycles are time stamp counter cycles where the host has one,
+ * nanoseconds otherwise.
+ */
+
+#define DATA_LENGTH 256
+#define ITERATIONS 20000
+#define RUNS 5
+
+static bool nibble_write_hex(const uint8_t *data, char *string, size_t length)
+{
+    for (size_t position = 0; position < length; position++) {
+        uint8_t value = data[position];
+
+        for (size_t place = 0; place < 2; place++) {
+            char digit = value & 0x0f;
+
+            value >>= 4;
+
+            if (digit <= 9) {
+                digit += '0';
+            } else {
+                digit += 'a' - 10;
+            }
+
+            string[position * 2 + 1 - place] = digit;
+        }
+    }
+
+    string[length * 2] = '\0';
+
+    return true;
+}
+
+static bool nibble_read_hex(const char *string, uint8_t *data, size_t length)
+{
+    for (size_t position = 0; position < length; position++) {
+        uint8_t value = 0;
+
+        for (size_t place = 0; place < 2; place++) {
+            char digit = string[position * 2 + place];
+
+            value <<= 4;
+
+            if ((digit >= '0') && (digit <= '9')) {
+                value += digit - '0';
+            } else if ((digit >= 'a') && (digit <= 'f')) {
+                value += digit - 'a' + 10;
+            } else {
+                return false;
+            }
+        }
+
+        data[position] = value;
+    }
+
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLE_UNIT "cycles"
+
+static uint64_t cycles(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define CYCLE_UNIT "ns"
+
+static uint64_t cycles(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+#endif
+
+typedef bool (*hex_writer)(const uint8_t *data, char *string, size_t length);
+typedef bool (*hex_reader)(const char *string, uint8_t *data, size_t length);
+
+static uint8_t data[DATA_LENGTH];
+static uint32_t string_words[(2 * DATA_LENGTH + 8) / 4];
+
+// Keeps the compiler from dropping results that are never looked at
+static void use(const void *pointer)
+{
+    __asm__ volatile("" : : "r"(pointer) : "memory");
+}
+
+// The best of a few runs, which is the least disturbed by the host
+static double measure_write(hex_writer writer, char *string)
+{
+    double best = 0;
+
+    for (unsigned run = 0; run < RUNS; run++) {
+        uint64_t start = cycles();
+
+        for (unsigned iteration = 0; iteration < ITERATIONS; iteration++) {
+            writer(data, string, DATA_LENGTH);
+            use(string);
+        }
+
+        double per_byte = (double)(cycles() - start) /
+                          ((double)ITERATIONS * DATA_LENGTH);
+
+        if ((run == 0) || (per_byte < best)) {
+            best = per_byte;
+        }
+    }
+
+    return best;
+}
+
+static double measure_read(hex_reader reader, const char *string)
+{
+    uint8_t decoded[DATA_LENGTH];
+    double best = 0;
+
+    for (unsigned run = 0; run < RUNS; run++) {
+        uint64_t start = cycles();
+
+        for (unsigned iteration = 0; iteration < ITERATIONS; iteration++) {
+            if (!reader(string, decoded, DATA_LENGTH)) {
+                printf("decoding failed\n");
+                exit(1);
+            }
+
+            use(decoded);
+        }
+
+        double per_byte = (double)(cycles() - start) /
+                          ((double)ITERATIONS * DATA_LENGTH);
+
+        if ((run == 0) || (per_byte < best)) {
+            best = per_byte;
+        }
+    }
+
+    return best;
+}
+
+int main(void)
+{
+    for (size_t index = 0; index < DATA_LENGTH; index++) {
+        data[index] = (uint8_t)(index * 167 + 13);
+    }
+
+    printf("%-26s %10s %10s\n", "hex codec, " CYCLE_UNIT "/byte",
+           "before", "after");
+
+    for (size_t offset = 0; offset < 2; offset++) {
+        char *string = (char *)string_words + offset;
+        const char *alignment = (offset == 0) ? "aligned" : "odd";
+
+        double before = measure_write(nibble_write_hex, string);
+        double after = measure_write(write_hex, string);
+
+        printf("write_hex, %-15s %10.2f %10.2f\n", alignment, before, after);
+
+        before = measure_read(nibble_read_hex, string);
+        after = measure_read(read_hex, string);
+
+        printf("read_hex, %-16s %10.2f %10.2f\n", alignment, before, after);
+    }
+
+    return 0;
+}
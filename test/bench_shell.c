@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 199309L
+
+// The shell is included whole so that its task can be run directly
+#include "../application/src/shell.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "stubs.h"
+
+/*
+ * Runs workloads through the shell task with the real I2C and USB drivers
+ * on the simulated peripherals. A request is the input of one round trip:
+ * it is sent in full-speed USB packets and its latency lasts until every
+ * answer has been received. The simulated figures count the time on the
+ * bus and the USB link, with the firmware taking none, the host figures
+ * the CPU time of the host running the shell, drivers and simulation.
+ */
+
+#define USB_PACKET_LENGTH 64
+
+#define WARMUP_REQUESTS 1000
+#define MEASURED_REQUESTS 20000
+
+struct request
+{
+    const char *data;
+    size_t length;
+};
+
+#define REQUEST(string) {string, sizeof(string) - 1}
+
+// Requests are sent in turn, each carrying the same number of commands
+struct workload
+{
+    const char *name;
+    bool binary;
+    unsigned commands;
+    size_t request_count;
+    struct request requests[2];
+};
+
+static const struct workload workloads[] = {
+    {
+        "text single-byte write", false, 1, 1,
+        {REQUEST("WRITE 50 2 10aa\n")}
+    },
+    {
+        "text 64-byte read", false, 1, 1,
+        {REQUEST("WRITE_READ 50 1 00 64\n")}
+    },
+    {
+        "text mixed write-read", false, 1, 2,
+        {REQUEST("WRITE 50 2 10aa\n"), REQUEST("WRITE_READ 50 1 10 4\n")}
+    },
+    {
+        "text pipelined burst of 8", false, 8, 1,
+        {REQUEST("WRITE_READ 50 1 00 4\nWRITE_READ 50 1 04 4\n"
+                 "WRITE_READ 50 1 08 4\nWRITE_READ 50 1 0c 4\n"
+                 "WRITE_READ 50 1 10 4\nWRITE_READ 50 1 14 4\n"
+                 "WRITE_READ 50 1 18 4\nWRITE_READ 50 1 1c 4\n")}
+    },
+    {
+        "binary single-byte write", true, 1, 1,
+        {REQUEST("\x06\x02\x50\x02\x00\x10\xaa")}
+    },
+    {
+        "binary 64-byte read", true, 1, 1,
+        {REQUEST("\x07\x03\x50\x01\x00\x00\x40\x00")}
+    },
+    {
+        "binary mixed write-read", true, 1, 2,
+        {REQUEST("\x06\x02\x50\x02\x00\x10\xaa"),
+         REQUEST("\x07\x03\x50\x01\x00\x10\x04\x00")}
+    },
+    {
+        "binary pipelined burst of 8", true, 8, 1,
+        {REQUEST("\x07\x03\x50\x01\x00\x00\x04\x00"
+                 "\x07\x03\x50\x01\x00\x04\x04\x00"
+                 "\x07\x03\x50\x01\x00\x08\x04\x00"
+                 "\x07\x03\x50\x01\x00\x0c\x04\x00"
+                 "\x07\x03\x50\x01\x00\x10\x04\x00"
+                 "\x07\x03\x50\x01\x00\x14\x04\x00"
+                 "\x07\x03\x50\x01\x00\x18\x04\x00"
+                 "\x07\x03\x50\x01\x00\x1c\x04\x00")}
+    }
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static uint64_t latencies[MEASURED_REQUESTS];
+static uint64_t host_latencies[MEASURED_REQUESTS];
+
+static uint64_t now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+
+static int compare_latencies(const void *first, const void *second)
+{
+    uint64_t a = *(const uint64_t *)first;
+    uint64_t b = *(const uint64_t *)second;
+
+    return (a > b) - (a < b);
+}
+
+static void run_workload(const struct workload *workload)
+{
+    host_reset();
+    host_add_target(0x50);
+
+    binary_mode = workload->binary;
+
+    uint64_t input_bytes = 0;
+    uint64_t output_bytes = 0;
+    uint64_t total = 0;
+
+    for (unsigned request = 0;
+         request < WARMUP_REQUESTS + MEASURED_REQUESTS;
+         request++) {
+        const struct request *input =
+            &workload->requests[request % workload->request_count];
+
+        host_clear_output();
+
+        uint64_t start = host_time();
+        uint64_t host_start = now();
+
+        host_run(shell_task, (const uint8_t *)input->data, input->length,
+                 USB_PACKET_LENGTH);
+
+        uint64_t host_latency = now() - host_start;
+        uint64_t latency = host_time() - start;
+
+        if (request < WARMUP_REQUESTS) {
+            continue;
+        }
+
+        size_t output_length;
+        host_output(&output_length);
+
+        latencies[request - WARMUP_REQUESTS] = latency;
+        host_latencies[request - WARMUP_REQUESTS] = host_latency;
+        total += latency;
+        input_bytes += input->length;
+        output_bytes += output_length;
+    }
+
+    qsort(latencies, MEASURED_REQUESTS, sizeof(latencies[0]),
+          compare_latencies);
+    qsort(host_latencies, MEASURED_REQUESTS, sizeof(host_latencies[0]),
+          compare_latencies);
+
+    uint64_t commands = (uint64_t)MEASURED_REQUESTS * workload->commands;
+
+    printf("%-30s %8.0f %8.1f %8.1f %8.2f %8.2f %6.1f %6.1f\n",
+           workload->name,
+           (double)commands * 1e9 / (double)total,
+           (double)latencies[MEASURED_REQUESTS / 2] / 1000,
+           (double)latencies[MEASURED_REQUESTS * 99 / 100] / 1000,
+           (double)host_latencies[MEASURED_REQUESTS / 2] / 1000,
+           (double)host_latencies[MEASURED_REQUESTS * 99 / 100] / 1000,
+           (double)input_bytes / (double)commands,
+           (double)output_bytes / (double)commands);
+}
+
+static void run_workloads(void)
+{
+    printf("%-30s %8s %8s %8s %8s %8s %6s %6s\n",
+           "workload", "ops/s", "p50 us", "p99 us", "host p50", "host p99",
+           "in", "out");
+
+    for (size_t index = 0; index < WORKLOAD_COUNT; index++) {
+        run_workload(&workloads[index]);
+    }
+}
+
+int main(void)
+{
+    host_start(run_workloads);
+
+    return 0;
+}
@@ -0,0 +1,440 @@
+#include "simulation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#define MAX_TASKS 4
+#define TASK_STACK_SIZE 0x40000
+
+struct simulation_task
+{
+    bool used;
+    bool ready;
+    bool timed_out;
+    UBaseType_t priority;
+    TaskFunction_t function;
+    void *parameter;
+
+    // What a waiting task waits for, and until when
+    const void *object;
+    uint64_t deadline;
+
+    uint32_t notification;
+    bool notified;
+
+    ucontext_t context;
+};
+
+uint64_t simulation_time = 0;
+
+static struct simulation_task tasks[MAX_TASKS];
+
+// Static like every other buffer of the non-PIE build, so that addresses
+// on the stacks fit the 32-bit DMA address registers
+static uint8_t stacks[MAX_TASKS][TASK_STACK_SIZE]
+    __attribute__((aligned(16)));
+
+static struct simulation_task *current_task = NULL;
+static ucontext_t scheduler_context;
+static unsigned interrupt_nesting = 0;
+
+static void (*main_function)(void);
+static bool main_finished;
+
+// The task in simulation_wait_idle() and the timeouts it lets pass
+static struct simulation_task *idle_waiter = NULL;
+static unsigned idle_timeouts;
+
+// Objects for the waits that nothing but a timeout ends
+static const char sleeping;
+
+static void simulation_fail(const char *message)
+{
+    fprintf(stderr, "simulation: %s\n", message);
+    abort();
+}
+
+static void task_entry(void)
+{
+    current_task->function(current_task->parameter);
+
+    // Only the main task returns, the scheduler stops with it
+    current_task->used = false;
+    main_finished = true;
+}
+
+static struct simulation_task *task_create(TaskFunction_t function,
+                                           void *parameter,
+                                           UBaseType_t priority)
+{
+    for (size_t index = 0; index < MAX_TASKS; index++) {
+        struct simulation_task *task = &tasks[index];
+
+        if (task->used) {
+            continue;
+        }
+
+        memset(task, 0, sizeof(*task));
+
+        task->used = true;
+        task->ready = true;
+        task->priority = priority;
+        task->function = function;
+        task->parameter = parameter;
+        task->deadline = SIMULATION_NEVER;
+
+        getcontext(&task->context);
+        task->context.uc_stack.ss_sp = stacks[index];
+        task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+        task->context.uc_link = &scheduler_context;
+        makecontext(&task->context, task_entry, 0);
+
+        return task;
+    }
+
+    simulation_fail("too many tasks");
+    return NULL;
+}
+
+// Hands the processor back to the scheduler until the task is picked again
+static void task_switch(void)
+{
+    swapcontext(&current_task->context, &scheduler_context);
+}
+
+// Gives the processor to a task with a higher priority that became ready
+static void task_preempt(void)
+{
+    if (!current_task || (interrupt_nesting > 0)) {
+        return;
+    }
+
+    for (size_t index = 0; index < MAX_TASKS; index++) {
+        struct simulation_task *task = &tasks[index];
+
+        if (task->used && task->ready &&
+            (task->priority > current_task->priority)) {
+            task_switch();
+            return;
+        }
+    }
+}
+
+// Waits for a wake-up on the object until the deadline, false on timeout
+static bool task_wait(const void *object, uint64_t deadline)
+{
+    if (!current_task || (interrupt_nesting > 0)) {
+        simulation_fail("waiting outside of a task");
+    }
+
+    current_task->ready = false;
+    current_task->timed_out = false;
+    current_task->object = object;
+    current_task->deadline = deadline;
+
+    task_switch();
+
+    return !current_task->timed_out;
+}
+
+static void task_wake(const void *object)
+{
+    for (size_t index = 0; index < MAX_TASKS; index++) {
+        struct simulation_task *task = &tasks[index];
+
+        if (task->used && !task->ready && (task->object == object)) {
+            task->ready = true;
+            task->object = NULL;
+            task->deadline = SIMULATION_NEVER;
+        }
+    }
+
+    task_preempt();
+}
+
+static uint64_t tick_deadline(TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY) {
+        return SIMULATION_NEVER;
+    }
+
+    return ((uint64_t)xTaskGetTickCount() + ticks) * NANOSECONDS_PER_TICK;
+}
+
+static struct simulation_task *task_next(void)
+{
+    struct simulation_task *next = NULL;
+
+    for (size_t index = 0; index < MAX_TASKS; index++) {
+        struct simulation_task *task = &tasks[index];
+
+        if (task->used && task->ready &&
+            (!next || (task->priority > next->priority))) {
+            next = task;
+        }
+    }
+
+    return next;
+}
+
+static uint64_t task_deadline(void)
+{
+    uint64_t deadline = SIMULATION_NEVER;
+
+    for (size_t index = 0; index < MAX_TASKS; index++) {
+        struct simulation_task *task = &tasks[index];
+
+        if (task->used && !task->ready && (task->deadline < deadline)) {
+            deadline = task->deadline;
+        }
+    }
+
+    return deadline;
+}
+
+static void task_expire(void)
+{
+    for (size_t index = 0; index < MAX_TASKS; index++) {
+        struct simulation_task *task = &tasks[index];
+
+        if (task->used && !task->ready &&
+            (task->deadline <= simulation_time)) {
+            task->ready = true;
+            task->timed_out = true;
+            task->object = NULL;
+            task->deadline = SIMULATION_NEVER;
+        }
+    }
+}
+
+static void simulation_schedule(void)
+{
+    while (!main_finished) {
+        nvic_model_dispatch();
+
+        struct simulation_task *task = task_next();
+
+        if (task) {
+            current_task = task;
+            swapcontext(&scheduler_context, &task->context);
+            current_task = NULL;
+            continue;
+        }
+
+        uint64_t event = i2c_model_next_event();
+        uint64_t usb_event = usb_model_next_event();
+        uint64_t deadline = task_deadline();
+
+        if (usb_event < event) {
+            event = usb_event;
+        }
+
+        if ((event != SIMULATION_NEVER) && (event <= deadline)) {
+            if (event > simulation_time) {
+                simulation_time = event;
+            }
+
+            i2c_model_run();
+            usb_model_run();
+            continue;
+        }
+
+        if (idle_waiter && (event == SIMULATION_NEVER)) {
+            if ((idle_timeouts == 0) || (deadline == SIMULATION_NEVER)) {
+                idle_waiter->ready = true;
+                idle_waiter->object = NULL;
+                idle_waiter = NULL;
+                continue;
+            }
+
+            idle_timeouts--;
+        }
+
+        if (deadline == SIMULATION_NEVER) {
+            simulation_fail("every task waits forever");
+        }
+
+        if (deadline > simulation_time) {
+            simulation_time = deadline;
+        }
+
+        task_expire();
+    }
+}
+
+static void main_entry(void *parameter)
+{
+    (void)parameter;
+
+    main_function();
+}
+
+void simulation_start(void (*function)(void))
+{
+    main_function = function;
+    main_finished = false;
+
+    task_create(main_entry, NULL, 0);
+
+    simulation_schedule();
+}
+
+void simulation_reset(void)
+{
+    for (size_t index = 0; index < MAX_TASKS; index++) {
+        if (&tasks[index] != current_task) {
+            tasks[index].used = false;
+        }
+    }
+
+    idle_waiter = NULL;
+}
+
+void simulation_wait_idle(unsigned timeouts)
+{
+    idle_waiter = current_task;
+    idle_timeouts = timeouts;
+
+    task_wait(&idle_waiter, SIMULATION_NEVER);
+}
+
+void simulation_sleep_until(uint64_t time)
+{
+    if (time > simulation_time) {
+        task_wait(&sleeping, time);
+    }
+}
+
+void simulation_delete_task(void *task)
+{
+    ((struct simulation_task *)task)->used = false;
+}
+
+void simulation_interrupt(void (*handler)(void))
+{
+    interrupt_nesting++;
+    handler();
+    interrupt_nesting--;
+}
+
+void simulation_preempt(void)
+{
+    task_preempt();
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(simulation_time / NANOSECONDS_PER_TICK);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function,
+                               const char * const name,
+                               const uint32_t stack_depth,
+                               void * const parameters,
+                               UBaseType_t priority,
+                               StackType_t * const stack,
+                               StaticTask_t * const task)
+{
+    // The tasks run on stacks of the host, which calls need more of
+    (void)name;
+    (void)stack_depth;
+    (void)stack;
+    (void)task;
+
+    struct simulation_task *created = task_create(function, parameters,
+                                                  priority);
+
+    task_preempt();
+
+    return created;
+}
+
+BaseType_t xTaskGenericNotify(TaskHandle_t handle,
+                              uint32_t value,
+                              eNotifyAction action,
+                              uint32_t *previous)
+{
+    struct simulation_task *task = handle;
+
+    if (previous) {
+        *previous = task->notification;
+    }
+
+    switch (action) {
+    case eSetBits:
+        task->notification |= value;
+        break;
+
+    case eIncrement:
+        task->notification++;
+        break;
+
+    case eSetValueWithoutOverwrite:
+        if (task->notified) {
+            return pdFAIL;
+        }
+        task->notification = value;
+        break;
+
+    case eSetValueWithOverwrite:
+        task->notification = value;
+        break;
+
+    default:
+        break;
+    }
+
+    task->notified = true;
+    task_wake(&task->notification);
+
+    return pdPASS;
+}
+
+BaseType_t xTaskGenericNotifyFromISR(TaskHandle_t handle,
+                                     uint32_t value,
+                                     eNotifyAction action,
+                                     uint32_t *previous,
+                                     BaseType_t *woken)
+{
+    // The scheduler switches once the interrupt returns
+    if (woken) {
+        *woken = pdFALSE;
+    }
+
+    return xTaskGenericNotify(handle, value, action, previous);
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t handle, BaseType_t *woken)
+{
+    xTaskGenericNotifyFromISR(handle, 0, eIncrement, NULL, woken);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct simulation_task *task = current_task;
+
+    if ((task->notification == 0) && (ticks != 0)) {
+        task->notified = false;
+        task_wait(&task->notification, tick_deadline(ticks));
+    }
+
+    uint32_t value = task->notification;
+
+    if (value != 0) {
+        task->notification = clear ? 0 : value - 1;
+    }
+
+    task->notified = false;
+
+    return value;
+}
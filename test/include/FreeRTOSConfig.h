@@ -0,0 +1,51 @@
+#pragma once
+
+// The firmware configuration, with the Cortex-M0 port replaced by the
+// scheduler of the host build. Defining PORTMACRO_H keeps the port header
+// out, so these are its definitions for the host.
+
+#include "../../application/include/FreeRTOSConfig.h"
+
+#define PORTMACRO_H
+
+#define portCHAR char
+#define portFLOAT float
+#define portDOUBLE double
+#define portLONG long
+#define portSHORT short
+#define portSTACK_TYPE uint32_t
+#define portBASE_TYPE long
+
+typedef portSTACK_TYPE StackType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+typedef uint32_t TickType_t;
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_TYPE_IS_ATOMIC 1
+
+#define portSTACK_GROWTH (-1)
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define portBYTE_ALIGNMENT 8
+
+// Tasks switch when they block, interrupts never switch them directly
+#define portYIELD()
+#define portEND_SWITCHING_ISR(switch_required) ((void)(switch_required))
+#define portYIELD_FROM_ISR(switch_required) \
+    portEND_SWITCHING_ISR(switch_required)
+
+// Interrupts only run where a task waits or unmasks them, never inside a
+// critical section
+#define portSET_INTERRUPT_MASK_FROM_ISR() 0
+#define portCLEAR_INTERRUPT_MASK_FROM_ISR(mask) ((void)(mask))
+#define portDISABLE_INTERRUPTS()
+#define portENABLE_INTERRUPTS()
+#define portENTER_CRITICAL()
+#define portEXIT_CRITICAL()
+
+#define portTASK_FUNCTION_PROTO(function, parameters) \
+    void function(void *parameters)
+#define portTASK_FUNCTION(function, parameters) \
+    void function(void *parameters)
+
+#define portNOP()
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Registers of the host build live in the peripheral models, which apply
+// the side effects of the previous access on every access
+volatile uint32_t *host_mmio32(uint32_t address);
+
+#define MMIO32(address) (*host_mmio32(address))
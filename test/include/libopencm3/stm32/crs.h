@@ -0,0 +1,3 @@
+#pragma once
+
+void crs_autotrim_usb_enable(void);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <libopencm3/stm32/common.h>
+
+// The DMA registers of the STM32F0 as far as the firmware uses them
+
+#define DMA1 0x40020000
+
+#define DMA_CHANNEL2 2
+#define DMA_CHANNEL3 3
+
+#define DMA_ISR(dma) MMIO32((dma) + 0x00)
+#define DMA_IFCR(dma) MMIO32((dma) + 0x04)
+#define DMA_CCR(dma, channel) MMIO32((dma) + 0x08 + 0x14 * ((channel) - 1))
+#define DMA_CNDTR(dma, channel) MMIO32((dma) + 0x0c + 0x14 * ((channel) - 1))
+#define DMA_CPAR(dma, channel) MMIO32((dma) + 0x10 + 0x14 * ((channel) - 1))
+#define DMA_CMAR(dma, channel) MMIO32((dma) + 0x14 + 0x14 * ((channel) - 1))
+
+#define DMA_FLAG_OFFSET(channel) (4 * ((channel) - 1))
+
+#define DMA_GIF (1 << 0)
+#define DMA_TCIF (1 << 1)
+#define DMA_HTIF (1 << 2)
+#define DMA_TEIF (1 << 3)
+
+#define DMA_ISR_GIF_BIT DMA_GIF
+#define DMA_ISR_TCIF_BIT DMA_TCIF
+#define DMA_ISR_HTIF_BIT DMA_HTIF
+#define DMA_ISR_TEIF_BIT DMA_TEIF
+
+#define DMA_IFCR_CGIF_BIT DMA_GIF
+
+#define DMA_CCR_EN (1 << 0)
+#define DMA_CCR_TCIE (1 << 1)
+#define DMA_CCR_HTIE (1 << 2)
+#define DMA_CCR_TEIE (1 << 3)
+#define DMA_CCR_DIR (1 << 4)
+#define DMA_CCR_CIRC (1 << 5)
+#define DMA_CCR_PINC (1 << 6)
+#define DMA_CCR_MINC (1 << 7)
+#define DMA_CCR_PSIZE_8BIT (0 << 8)
+#define DMA_CCR_MSIZE_8BIT (0 << 10)
+
+void dma_enable_channel(uint32_t dma, uint8_t channel);
+void dma_disable_channel(uint32_t dma, uint8_t channel);
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t flag);
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel,
+                               uint32_t flags);
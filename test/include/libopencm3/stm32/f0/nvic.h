@@ -0,0 +1,17 @@
+#pragma once
+
+#include <libopencm3/stm32/common.h>
+
+// The interrupts of the STM32F0 the firmware handles
+
+#define NVIC_DMA1_CHANNEL2_3_IRQ 10
+#define NVIC_I2C1_IRQ 23
+#define NVIC_USB_IRQ 31
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+void nvic_clear_pending_irq(uint8_t irqn);
+
+void dma1_channel2_3_isr(void);
+void i2c1_isr(void);
+void usb_isr(void);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+// Programmed into the simulated macro page of the host build
+
+void flash_unlock(void);
+
+void flash_lock(void);
+
+void flash_erase_page(uint32_t page_address);
+
+void flash_program_half_word(uint32_t address, uint16_t data);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <libopencm3/stm32/common.h>
+
+// The pins of the host build read back what the bus lines are driven to
+
+#define GPIOA 0x48000000
+#define GPIOF 0x48001400
+
+#define GPIO0 (1 << 0)
+#define GPIO1 (1 << 1)
+#define GPIO11 (1 << 11)
+#define GPIO12 (1 << 12)
+
+#define GPIO_MODE_INPUT 0x00
+#define GPIO_MODE_OUTPUT 0x01
+#define GPIO_MODE_AF 0x02
+#define GPIO_MODE_ANALOG 0x03
+
+#define GPIO_PUPD_NONE 0x00
+
+#define GPIO_OTYPE_PP 0x00
+#define GPIO_OTYPE_OD 0x01
+
+#define GPIO_OSPEED_2MHZ 0x00
+#define GPIO_OSPEED_HIGH 0x03
+
+#define GPIO_AF1 0x01
+
+void gpio_mode_setup(uint32_t port, uint8_t mode, uint8_t pull_up_down,
+                     uint16_t gpios);
+void gpio_set_output_options(uint32_t port, uint8_t type, uint8_t speed,
+                             uint16_t gpios);
+void gpio_set_af(uint32_t port, uint8_t alternate_function, uint16_t gpios);
+void gpio_set(uint32_t port, uint16_t gpios);
+void gpio_clear(uint32_t port, uint16_t gpios);
+uint16_t gpio_get(uint32_t port, uint16_t gpios);
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <libopencm3/stm32/common.h>
+
+// The I2C registers of the STM32F0 as far as the firmware uses them
+
+#define I2C1 0x40005400
+
+#define I2C_CR1(i2c) MMIO32((i2c) + 0x00)
+#define I2C_CR2(i2c) MMIO32((i2c) + 0x04)
+#define I2C_TIMINGR(i2c) MMIO32((i2c) + 0x10)
+#define I2C_TIMEOUTR(i2c) MMIO32((i2c) + 0x14)
+#define I2C_ISR(i2c) MMIO32((i2c) + 0x18)
+#define I2C_ICR(i2c) MMIO32((i2c) + 0x1c)
+#define I2C_PECR(i2c) MMIO32((i2c) + 0x20)
+#define I2C_RXDR(i2c) MMIO32((i2c) + 0x24)
+#define I2C_TXDR(i2c) MMIO32((i2c) + 0x28)
+
+#define I2C1_RXDR I2C_RXDR(I2C1)
+#define I2C1_TXDR I2C_TXDR(I2C1)
+
+#define I2C_CR1_PE (1 << 0)
+#define I2C_CR1_TXIE (1 << 1)
+#define I2C_CR1_RXIE (1 << 2)
+#define I2C_CR1_ADDRIE (1 << 3)
+#define I2C_CR1_NACKIE (1 << 4)
+#define I2C_CR1_STOPIE (1 << 5)
+#define I2C_CR1_TCIE (1 << 6)
+#define I2C_CR1_ERRIE (1 << 7)
+#define I2C_CR1_TXDMAEN (1 << 14)
+#define I2C_CR1_RXDMAEN (1 << 15)
+#define I2C_CR1_PECEN (1 << 23)
+
+#define I2C_CR2_SADD_7BIT_SHIFT 1
+#define I2C_CR2_SADD_7BIT_MASK (0x7f << 1)
+#define I2C_CR2_RD_WRN (1 << 10)
+#define I2C_CR2_ADD10 (1 << 11)
+#define I2C_CR2_START (1 << 13)
+#define I2C_CR2_STOP (1 << 14)
+#define I2C_CR2_NACK (1 << 15)
+#define I2C_CR2_NBYTES_SHIFT 16
+#define I2C_CR2_NBYTES_MASK (0xff << I2C_CR2_NBYTES_SHIFT)
+#define I2C_CR2_RELOAD (1 << 24)
+#define I2C_CR2_AUTOEND (1 << 25)
+#define I2C_CR2_PECBYTE (1 << 26)
+
+#define I2C_ISR_TXE (1 << 0)
+#define I2C_ISR_TXIS (1 << 1)
+#define I2C_ISR_RXNE (1 << 2)
+#define I2C_ISR_NACKF (1 << 4)
+#define I2C_ISR_STOPF (1 << 5)
+#define I2C_ISR_TC (1 << 6)
+#define I2C_ISR_TCR (1 << 7)
+#define I2C_ISR_BERR (1 << 8)
+#define I2C_ISR_ARLO (1 << 9)
+#define I2C_ISR_OVR (1 << 10)
+#define I2C_ISR_PECERR (1 << 11)
+#define I2C_ISR_TIMEOUT (1 << 12)
+#define I2C_ISR_ALERT (1 << 13)
+#define I2C_ISR_BUSY (1 << 15)
+
+#define I2C_ICR_NACKCF (1 << 4)
+#define I2C_ICR_STOPCF (1 << 5)
+#define I2C_ICR_BERRCF (1 << 8)
+#define I2C_ICR_ARLOCF (1 << 9)
+#define I2C_ICR_OVRCF (1 << 10)
+#define I2C_ICR_PECCF (1 << 11)
+#define I2C_ICR_TIMOUTCF (1 << 12)
+#define I2C_ICR_ALERTCF (1 << 13)
+
+#define I2C_TIMINGR_PRESC_SHIFT 28
+#define I2C_TIMINGR_SCLDEL_SHIFT 20
+#define I2C_TIMINGR_SDADEL_SHIFT 16
+#define I2C_TIMINGR_SCLH_SHIFT 8
+#define I2C_TIMINGR_SCLL_SHIFT 0
+
+#define I2C_TIMEOUTR_TIMEOUTA_MASK 0xfff
+#define I2C_TIMEOUTR_TIDLE (1 << 12)
+#define I2C_TIMEOUTR_TIMOUTEN (1 << 15)
+
+void i2c_peripheral_enable(uint32_t i2c);
+void i2c_peripheral_disable(uint32_t i2c);
+void i2c_enable_rxdma(uint32_t i2c);
+void i2c_enable_txdma(uint32_t i2c);
+void i2c_enable_interrupt(uint32_t i2c, uint32_t interrupt);
+void i2c_set_7bit_addr_mode(uint32_t i2c);
+void i2c_set_7bit_address(uint32_t i2c, uint8_t address);
+void i2c_set_write_transfer_dir(uint32_t i2c);
+void i2c_set_read_transfer_dir(uint32_t i2c);
+void i2c_send_start(uint32_t i2c);
+void i2c_send_stop(uint32_t i2c);
+bool i2c_transfer_complete(uint32_t i2c);
+bool i2c_nack(uint32_t i2c);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <libopencm3/stm32/common.h>
+
+// Clocks are always running on the host
+
+enum rcc_periph_clken
+{
+    RCC_GPIOA,
+    RCC_GPIOF,
+    RCC_SYSCFG_COMP,
+    RCC_CRS,
+    RCC_USB,
+    RCC_I2C1,
+    RCC_DMA1
+};
+
+enum rcc_osc
+{
+    RCC_HSI48
+};
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_set_i2c_clock_sysclk(uint32_t i2c);
+void rcc_set_usbclk_source(enum rcc_osc clock);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <libopencm3/stm32/common.h>
+
+// The USB interrupt registers, the endpoints are left to the usbd stand-in
+
+#define USB_DEV_FS_BASE 0x40005c00
+
+#define USB_CNTR_REG (&MMIO32(USB_DEV_FS_BASE + 0x40))
+#define USB_ISTR_REG (&MMIO32(USB_DEV_FS_BASE + 0x44))
+
+#define USB_CNTR_SOFM (1 << 9)
+#define USB_CNTR_RESETM (1 << 10)
+#define USB_CNTR_SUSPM (1 << 11)
+#define USB_CNTR_WKUPM (1 << 12)
+#define USB_CNTR_CTRM (1 << 15)
+
+#define USB_ISTR_SOF (1 << 9)
+#define USB_ISTR_RESET (1 << 10)
+#define USB_ISTR_SUSP (1 << 11)
+#define USB_ISTR_WKUP (1 << 12)
+#define USB_ISTR_CTR (1 << 15)
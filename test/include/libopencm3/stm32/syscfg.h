@@ -0,0 +1,10 @@
+#pragma once
+
+#include <libopencm3/stm32/common.h>
+
+#define SYSCFG_BASE 0x40010000
+
+#define SYSCFG_CFGR1 MMIO32(SYSCFG_BASE + 0x00)
+
+#define SYSCFG_CFGR1_PA11_PA12_RMP (1 << 4)
+#define SYSCFG_CFGR1_I2C1_FMP (1 << 20)
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+// The CDC class descriptors as libopencm3 lays them out
+
+#define CS_INTERFACE 0x24
+
+#define USB_CDC_SUBCLASS_ACM 0x02
+#define USB_CDC_PROTOCOL_NONE 0x00
+
+#define USB_CDC_TYPE_HEADER 0x00
+#define USB_CDC_TYPE_CALL_MANAGEMENT 0x01
+#define USB_CDC_TYPE_ACM 0x02
+#define USB_CDC_TYPE_UNION 0x06
+
+struct usb_cdc_header_descriptor
+{
+    uint8_t bFunctionLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint16_t bcdCDC;
+} __attribute__((packed));
+
+struct usb_cdc_call_management_descriptor
+{
+    uint8_t bFunctionLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bmCapabilities;
+    uint8_t bDataInterface;
+} __attribute__((packed));
+
+struct usb_cdc_acm_descriptor
+{
+    uint8_t bFunctionLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bmCapabilities;
+} __attribute__((packed));
+
+struct usb_cdc_union_descriptor
+{
+    uint8_t bFunctionLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bControlInterface;
+    uint8_t bSubordinateInterface0;
+} __attribute__((packed));
+
+struct usb_cdc_line_coding
+{
+    uint32_t dwDTERate;
+    uint8_t bCharFormat;
+    uint8_t bParityType;
+    uint8_t bDataBits;
+} __attribute__((packed));
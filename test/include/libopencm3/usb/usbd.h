@@ -0,0 +1,56 @@
+#pragma once
+
+#include <libopencm3/usb/usbstd.h>
+
+// The device stack of libopencm3, run by the USB model of the host build
+
+typedef struct _usbd_device usbd_device;
+typedef struct _usbd_driver usbd_driver;
+
+extern const usbd_driver st_usbfs_v2_usb_driver;
+
+enum usbd_request_return_codes
+{
+    USBD_REQ_NOTSUPP = 0,
+    USBD_REQ_HANDLED = 1,
+    USBD_REQ_NEXT_CALLBACK = 2
+};
+
+typedef void (*usbd_control_complete_callback)(usbd_device *device,
+                                               struct usb_setup_data *request);
+
+typedef enum usbd_request_return_codes (*usbd_control_callback)(
+    usbd_device *device, struct usb_setup_data *request, uint8_t **buffer,
+    uint16_t *length, usbd_control_complete_callback *complete);
+
+typedef void (*usbd_set_config_callback)(usbd_device *device,
+                                         uint16_t wValue);
+
+typedef void (*usbd_endpoint_callback)(usbd_device *device, uint8_t ep);
+
+usbd_device *usbd_init(const usbd_driver *driver,
+                       const struct usb_device_descriptor *dev,
+                       const struct usb_config_descriptor *conf,
+                       const char * const *strings, int num_strings,
+                       uint8_t *control_buffer,
+                       uint16_t control_buffer_size);
+
+int usbd_register_set_config_callback(usbd_device *device,
+                                      usbd_set_config_callback callback);
+
+int usbd_register_control_callback(usbd_device *device, uint8_t type,
+                                   uint8_t type_mask,
+                                   usbd_control_callback callback);
+
+void usbd_ep_setup(usbd_device *device, uint8_t address, uint8_t type,
+                   uint16_t max_size, usbd_endpoint_callback callback);
+
+uint16_t usbd_ep_write_packet(usbd_device *device, uint8_t address,
+                              const void *buffer, uint16_t length);
+
+uint16_t usbd_ep_read_packet(usbd_device *device, uint8_t address,
+                             void *buffer, uint16_t length);
+
+void usbd_ep_nak_set(usbd_device *device, uint8_t address, uint8_t nak);
+
+void usbd_poll(usbd_device *device);
@@ -0,0 +1,909 @@
+#include "simulation.h"
+#include "stubs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/stm32/f0/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/syscfg.h>
+#include <libopencm3/stm32/crs.h>
+#include <libopencm3/stm32/i2c.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/st_usbfs.h>
+
+/*
+ * The I2C peripheral is modelled a byte at a time. A byte takes nine SCL
+ * periods as loaded into TIMINGR, the START and address ten, the STOP one;
+ * the synchronisation and edge delays are left out. SCL is held low while
+ * the peripheral waits for software, through TC, TCR or a DMA channel
+ * that is not armed, and TIMEOUTA fails the transfer once that lasts too
+ * long. DMA moves the bytes between the data registers and memory.
+ */
+
+#define MAX_DMA_CHANNELS 7
+
+#define BYTE_BITS 9
+#define ADDRESS_BITS 10
+#define STOP_BITS 1
+
+// TIMEOUTA counts in units of 2048 I2C clock cycles
+#define TIMEOUT_CYCLES 2048
+
+#define I2C_ISR_ERRORS (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR | \
+                        I2C_ISR_PECERR | I2C_ISR_TIMEOUT | I2C_ISR_ALERT)
+
+struct host_target
+{
+    bool present;
+    uint8_t address_width;
+    uint16_t page_size;
+    uint16_t pointer;
+    uint16_t mask;
+    uint8_t *memory;
+    uint8_t registers[256];
+};
+
+static struct host_target targets[128];
+
+// The memory of the one target with two address bytes
+static uint8_t wide_memory[0x10000];
+
+static bool pec_failure = false;
+
+static struct
+{
+    uint32_t cr1;
+    uint32_t cr2;
+    uint32_t oar1;
+    uint32_t oar2;
+    uint32_t timingr;
+    uint32_t timeoutr;
+    uint32_t isr;
+    uint32_t icr;
+    uint32_t pecr;
+    uint32_t rxdr;
+    uint32_t txdr;
+} i2c;
+
+struct dma_channel
+{
+    uint32_t ccr;
+    uint32_t cndtr;
+    uint32_t cpar;
+    uint32_t cmar;
+    uint32_t reserved;
+
+    // The memory address the channel got to, CMAR stays as programmed
+    uint32_t pointer;
+    bool enabled;
+};
+
+static struct
+{
+    uint32_t isr;
+    uint32_t ifcr;
+    struct dma_channel channels[MAX_DMA_CHANNELS];
+} dma;
+
+static uint32_t syscfg_cfgr1;
+
+enum bus_state
+{
+    BUS_IDLE,
+    BUS_ADDRESS,
+    BUS_BYTE,
+    BUS_HELD,
+    BUS_STOP
+};
+
+static struct
+{
+    enum bus_state state;
+
+    // When the address, byte or STOP on the bus ends
+    uint64_t event;
+
+    // Since when SCL is held low
+    uint64_t held_since;
+
+    struct host_target *target;
+    bool read;
+    size_t count;
+    size_t position;
+    uint8_t byte;
+    bool pec_byte;
+} bus;
+
+// Register values the side effects were last applied for
+static uint32_t cr1_seen;
+static uint32_t timeoutr_seen;
+
+static uint32_t nvic_enabled;
+
+static void model_fail(const char *message)
+{
+    fprintf(stderr, "peripherals: %s\n", message);
+    abort();
+}
+
+void host_add_target(uint8_t address)
+{
+    host_add_eeprom(address, 1, 0);
+}
+
+void host_add_eeprom(uint8_t address, uint8_t address_width,
+                     uint16_t page_size)
+{
+    struct host_target *target = &targets[address & 0x7f];
+
+    target->present = true;
+    target->address_width = address_width;
+    target->page_size = page_size;
+
+    if (address_width == 2) {
+        target->memory = wide_memory;
+        target->mask = 0xffff;
+    } else {
+        target->memory = target->registers;
+        target->mask = 0xff;
+    }
+}
+
+void host_remove_target(uint8_t address)
+{
+    targets[address & 0x7f].present = false;
+}
+
+uint8_t *host_registers(uint8_t address)
+{
+    struct host_target *target = &targets[address & 0x7f];
+
+    return target->memory ? target->memory : target->registers;
+}
+
+void host_fail_pec(bool fail)
+{
+    pec_failure = fail;
+}
+
+// Takes the byte at the given position of a write, the first ones address
+static void host_receive(struct host_target *target, uint8_t byte,
+                         size_t position)
+{
+    if (position < target->address_width) {
+        target->pointer = (position == 0) ?
+                          byte : (uint16_t)((target->pointer << 8) | byte);
+        return;
+    }
+
+    target->memory[target->pointer & target->mask] = byte;
+
+    // Writes wrap around within a page, as on an EEPROM
+    uint16_t next = (uint16_t)(target->pointer + 1);
+    if (target->page_size > 0) {
+        uint16_t page_mask = (uint16_t)(target->page_size - 1);
+        next = (uint16_t)((target->pointer & ~page_mask) | (next & page_mask));
+    }
+
+    target->pointer = next & target->mask;
+}
+
+static uint8_t host_send(struct host_target *target)
+{
+    uint8_t byte = target->memory[target->pointer & target->mask];
+
+    target->pointer = (target->pointer + 1) & target->mask;
+
+    return byte;
+}
+
+// Nanoseconds per SCL period with the loaded timings
+static uint64_t bit_time(void)
+{
+    uint32_t presc = ((i2c.timingr >> I2C_TIMINGR_PRESC_SHIFT) & 0xf) + 1;
+    uint32_t scll = ((i2c.timingr >> I2C_TIMINGR_SCLL_SHIFT) & 0xff) + 1;
+    uint32_t sclh = ((i2c.timingr >> I2C_TIMINGR_SCLH_SHIFT) & 0xff) + 1;
+
+    return (uint64_t)presc * (scll + sclh) * 1000000000 / HOST_CLOCK;
+}
+
+static uint64_t timeout_time(void)
+{
+    uint64_t units = (i2c.timeoutr & I2C_TIMEOUTR_TIMEOUTA_MASK) + 1;
+
+    return units * TIMEOUT_CYCLES * 1000000000 / HOST_CLOCK;
+}
+
+static struct dma_channel *dma_channel(uint8_t channel)
+{
+    return &dma.channels[channel - 1];
+}
+
+// Whether the channel takes a request of the I2C peripheral
+static bool dma_ready(uint8_t channel)
+{
+    uint32_t enable = (channel == DMA_CHANNEL2) ? I2C_CR1_TXDMAEN :
+                                                  I2C_CR1_RXDMAEN;
+
+    return ((i2c.cr1 & enable) != 0) && dma_channel(channel)->enabled &&
+           (dma_channel(channel)->cndtr > 0);
+}
+
+// Moves the pointer on and flags the end of the count
+static uint8_t *dma_step(uint8_t channel)
+{
+    struct dma_channel *state = dma_channel(channel);
+    uint8_t *memory = (uint8_t *)(uintptr_t)state->pointer;
+
+    if ((state->ccr & DMA_CCR_MINC) != 0) {
+        state->pointer++;
+    }
+
+    if (--state->cndtr == 0) {
+        dma.isr |= (DMA_GIF | DMA_TCIF) << DMA_FLAG_OFFSET(channel);
+    }
+
+    return memory;
+}
+
+static void bus_hold(void)
+{
+    if (bus.state != BUS_HELD) {
+        bus.state = BUS_HELD;
+        bus.held_since = simulation_time;
+    }
+}
+
+static void bus_stop(void)
+{
+    bus.state = BUS_STOP;
+    bus.event = simulation_time + STOP_BITS * bit_time();
+}
+
+static void bus_release(void)
+{
+    bus.state = BUS_IDLE;
+    i2c.isr &= ~(I2C_ISR_BUSY | I2C_ISR_TC | I2C_ISR_TCR);
+}
+
+// Starts the next byte of the transfer or holds SCL until it can
+static void bus_next(void)
+{
+    if (bus.count == 0) {
+        if ((i2c.cr2 & I2C_CR2_RELOAD) != 0) {
+            // NBYTES reads back as zero so that its reload can be seen
+            i2c.isr |= I2C_ISR_TCR;
+            i2c.cr2 &= ~I2C_CR2_NBYTES_MASK;
+            bus_hold();
+        } else if ((i2c.cr2 & I2C_CR2_AUTOEND) != 0) {
+            bus_stop();
+        } else {
+            i2c.isr |= I2C_ISR_TC;
+            bus_hold();
+        }
+
+        return;
+    }
+
+    bus.pec_byte = (bus.count == 1) &&
+                   ((i2c.cr2 & (I2C_CR2_PECBYTE | I2C_CR2_RELOAD)) ==
+                    I2C_CR2_PECBYTE);
+
+    if (bus.read) {
+        // The byte received before has to be taken first
+        if ((i2c.isr & I2C_ISR_RXNE) != 0) {
+            bus_hold();
+            return;
+        }
+    } else if (!bus.pec_byte) {
+        if (!dma_ready(DMA_CHANNEL2)) {
+            bus_hold();
+            return;
+        }
+
+        bus.byte = *dma_step(DMA_CHANNEL2);
+    }
+
+    bus.state = BUS_BYTE;
+    bus.event = simulation_time + BYTE_BITS * bit_time();
+}
+
+static void bus_start(void)
+{
+    // A repeated START ends the TC of the transfer before
+    i2c.isr &= ~(I2C_ISR_TC | I2C_ISR_TCR);
+    i2c.isr |= I2C_ISR_BUSY;
+
+    bus.read = (i2c.cr2 & I2C_CR2_RD_WRN) != 0;
+    bus.target = &targets[(i2c.cr2 & I2C_CR2_SADD_7BIT_MASK) >>
+                          I2C_CR2_SADD_7BIT_SHIFT];
+    bus.count = (i2c.cr2 & I2C_CR2_NBYTES_MASK) >> I2C_CR2_NBYTES_SHIFT;
+
+    bus.state = BUS_ADDRESS;
+    bus.event = simulation_time + ADDRESS_BITS * bit_time();
+}
+
+static void bus_address_done(void)
+{
+    i2c.cr2 &= ~I2C_CR2_START;
+
+    // The master sends a STOP on its own after a NACK
+    if (!bus.target->present) {
+        i2c.isr |= I2C_ISR_NACKF;
+        bus_stop();
+        return;
+    }
+
+    bus.position = 0;
+    bus_next();
+}
+
+static void bus_byte_done(void)
+{
+    bus.count--;
+
+    if (!bus.read) {
+        // A PEC byte is checked by the target, not stored
+        if (!bus.pec_byte) {
+            host_receive(bus.target, bus.byte, bus.position++);
+        }
+    } else if (bus.pec_byte) {
+        i2c.rxdr = 0;
+        i2c.isr |= I2C_ISR_RXNE;
+
+        if (pec_failure) {
+            i2c.isr |= I2C_ISR_PECERR;
+        }
+    } else if (dma_ready(DMA_CHANNEL3)) {
+        *dma_step(DMA_CHANNEL3) = host_send(bus.target);
+    } else {
+        i2c.rxdr = host_send(bus.target);
+        i2c.isr |= I2C_ISR_RXNE;
+    }
+
+    bus_next();
+}
+
+static void bus_stop_done(void)
+{
+    i2c.cr2 &= ~I2C_CR2_STOP;
+    i2c.isr |= I2C_ISR_STOPF;
+
+    bus_release();
+}
+
+// Clearing PE resets the peripheral and lets go of the bus
+static void bus_reset(void)
+{
+    i2c.cr2 &= ~(I2C_CR2_START | I2C_CR2_STOP);
+    i2c.isr &= ~(I2C_ISR_TXIS | I2C_ISR_RXNE | I2C_ISR_NACKF |
+                 I2C_ISR_STOPF | I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR);
+
+    bus_release();
+}
+
+static void dma_model_sync(void)
+{
+    for (uint8_t channel = 1; channel <= MAX_DMA_CHANNELS; channel++) {
+        struct dma_channel *state = dma_channel(channel);
+        uint32_t offset = DMA_FLAG_OFFSET(channel);
+        uint32_t cleared = (dma.ifcr >> offset) & 0xf;
+
+        // Clearing GIF clears every flag of the channel
+        if ((cleared & DMA_GIF) != 0) {
+            cleared = 0xf;
+        }
+
+        dma.isr &= ~(cleared << offset);
+
+        if (((dma.isr >> offset) & (DMA_TCIF | DMA_HTIF | DMA_TEIF)) == 0) {
+            dma.isr &= ~(DMA_GIF << offset);
+        }
+
+        bool enabled = (state->ccr & DMA_CCR_EN) != 0;
+
+        if (enabled && !state->enabled) {
+            state->pointer = state->cmar;
+        }
+
+        state->enabled = enabled;
+    }
+
+    dma.ifcr = 0;
+}
+
+void i2c_model_sync(void)
+{
+    dma_model_sync();
+
+    i2c.isr &= ~i2c.icr;
+    i2c.icr = 0;
+
+    if (((cr1_seen & I2C_CR1_PE) != 0) && ((i2c.cr1 & I2C_CR1_PE) == 0)) {
+        bus_reset();
+    }
+
+    cr1_seen = i2c.cr1;
+
+    // The timeout counter starts over once it is enabled again
+    if (((timeoutr_seen & I2C_TIMEOUTR_TIMOUTEN) == 0) &&
+        ((i2c.timeoutr & I2C_TIMEOUTR_TIMOUTEN) != 0)) {
+        bus.held_since = simulation_time;
+    }
+
+    timeoutr_seen = i2c.timeoutr;
+
+    // A byte left in RXDR goes to a channel armed only now
+    if (((i2c.isr & I2C_ISR_RXNE) != 0) && dma_ready(DMA_CHANNEL3)) {
+        *dma_step(DMA_CHANNEL3) = (uint8_t)i2c.rxdr;
+        i2c.isr &= ~I2C_ISR_RXNE;
+    }
+
+    if ((i2c.cr1 & I2C_CR1_PE) == 0) {
+        return;
+    }
+
+    bool complete = (i2c.isr & I2C_ISR_TC) != 0;
+    bool reload = (i2c.isr & I2C_ISR_TCR) != 0;
+
+    // Setting START or STOP clears TC at once, even while the bus is busy
+    if ((i2c.cr2 & (I2C_CR2_START | I2C_CR2_STOP)) != 0) {
+        i2c.isr &= ~I2C_ISR_TC;
+    }
+
+    if (((i2c.cr2 & I2C_CR2_START) != 0) &&
+        ((bus.state == BUS_IDLE) || ((bus.state == BUS_HELD) && complete))) {
+        bus_start();
+    } else if (((i2c.cr2 & I2C_CR2_STOP) != 0) &&
+               (bus.state == BUS_HELD) && complete) {
+        bus_stop();
+    } else if ((bus.state == BUS_HELD) && reload) {
+        if ((i2c.cr2 & I2C_CR2_NBYTES_MASK) != 0) {
+            i2c.isr &= ~I2C_ISR_TCR;
+            bus.count = (i2c.cr2 & I2C_CR2_NBYTES_MASK) >>
+                        I2C_CR2_NBYTES_SHIFT;
+            bus_next();
+        }
+    } else if ((bus.state == BUS_HELD) && !complete) {
+        bus_next();
+    }
+}
+
+void i2c_model_reset(void)
+{
+    memset(targets, 0, sizeof(targets));
+    memset(wide_memory, 0, sizeof(wide_memory));
+    memset(&i2c, 0, sizeof(i2c));
+    memset(&dma, 0, sizeof(dma));
+    memset(&bus, 0, sizeof(bus));
+
+    i2c.isr = I2C_ISR_TXE;
+
+    cr1_seen = 0;
+    timeoutr_seen = 0;
+    syscfg_cfgr1 = 0;
+    pec_failure = false;
+}
+
+uint64_t i2c_model_next_event(void)
+{
+    switch (bus.state) {
+    case BUS_ADDRESS:
+    case BUS_BYTE:
+    case BUS_STOP:
+        return bus.event;
+
+    case BUS_HELD:
+        if ((i2c.timeoutr & I2C_TIMEOUTR_TIMOUTEN) != 0) {
+            return bus.held_since + timeout_time();
+        }
+        return SIMULATION_NEVER;
+
+    default:
+        return SIMULATION_NEVER;
+    }
+}
+
+void i2c_model_run(void)
+{
+    i2c_model_sync();
+
+    while (i2c_model_next_event() <= simulation_time) {
+        switch (bus.state) {
+        case BUS_ADDRESS:
+            bus_address_done();
+            break;
+
+        case BUS_BYTE:
+            bus_byte_done();
+            break;
+
+        case BUS_STOP:
+            bus_stop_done();
+            break;
+
+        default:
+            // SCL was held low for longer than TIMEOUTA allows
+            i2c.isr |= I2C_ISR_TIMEOUT;
+            bus_release();
+            break;
+        }
+
+        // A START or STOP requested meanwhile goes out once the bus is free
+        i2c_model_sync();
+    }
+}
+
+bool i2c_model_irq(void)
+{
+    uint32_t raised = 0;
+
+    if ((i2c.cr1 & I2C_CR1_TCIE) != 0) {
+        raised |= I2C_ISR_TC | I2C_ISR_TCR;
+    }
+
+    if ((i2c.cr1 & I2C_CR1_NACKIE) != 0) {
+        raised |= I2C_ISR_NACKF;
+    }
+
+    if ((i2c.cr1 & I2C_CR1_STOPIE) != 0) {
+        raised |= I2C_ISR_STOPF;
+    }
+
+    if ((i2c.cr1 & I2C_CR1_ERRIE) != 0) {
+        raised |= I2C_ISR_ERRORS;
+    }
+
+    return (i2c.isr & raised) != 0;
+}
+
+bool dma_model_irq(void)
+{
+    for (uint8_t channel = 1; channel <= MAX_DMA_CHANNELS; channel++) {
+        uint32_t flags = dma.isr >> DMA_FLAG_OFFSET(channel);
+        uint32_t ccr = dma_channel(channel)->ccr;
+
+        if ((((flags & DMA_TCIF) != 0) && ((ccr & DMA_CCR_TCIE) != 0)) ||
+            (((flags & DMA_HTIF) != 0) && ((ccr & DMA_CCR_HTIE) != 0)) ||
+            (((flags & DMA_TEIF) != 0) && ((ccr & DMA_CCR_TEIE) != 0))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static volatile uint32_t *i2c_register(uint32_t offset)
+{
+    switch (offset) {
+    case 0x00:
+        return &i2c.cr1;
+    case 0x04:
+        return &i2c.cr2;
+    case 0x08:
+        return &i2c.oar1;
+    case 0x0c:
+        return &i2c.oar2;
+    case 0x10:
+        return &i2c.timingr;
+    case 0x14:
+        return &i2c.timeoutr;
+    case 0x18:
+        return &i2c.isr;
+    case 0x1c:
+        return &i2c.icr;
+    case 0x20:
+        return &i2c.pecr;
+    case 0x24:
+        // Reading RXDR takes the byte
+        i2c.isr &= ~I2C_ISR_RXNE;
+        return &i2c.rxdr;
+    case 0x28:
+        return &i2c.txdr;
+    default:
+        model_fail("access to an unknown I2C register");
+        return NULL;
+    }
+}
+
+static volatile uint32_t *dma_register(uint32_t offset)
+{
+    if (offset == 0x00) {
+        return &dma.isr;
+    }
+
+    if (offset == 0x04) {
+        return &dma.ifcr;
+    }
+
+    uint32_t channel = (offset - 0x08) / 0x14;
+
+    if (channel >= MAX_DMA_CHANNELS) {
+        model_fail("access to an unknown DMA register");
+    }
+
+    switch ((offset - 0x08) % 0x14) {
+    case 0x00:
+        return &dma.channels[channel].ccr;
+    case 0x04:
+        return &dma.channels[channel].cndtr;
+    case 0x08:
+        return &dma.channels[channel].cpar;
+    case 0x0c:
+        return &dma.channels[channel].cmar;
+    default:
+        return &dma.channels[channel].reserved;
+    }
+}
+
+volatile uint32_t *host_mmio32(uint32_t address)
+{
+    i2c_model_sync();
+
+    if ((address >= I2C1) && (address < I2C1 + 0x400)) {
+        return i2c_register(address - I2C1);
+    }
+
+    if ((address >= DMA1) && (address < DMA1 + 0x400)) {
+        return dma_register(address - DMA1);
+    }
+
+    if ((address >= USB_DEV_FS_BASE) && (address < USB_DEV_FS_BASE + 0x400)) {
+        return usb_model_register(address - USB_DEV_FS_BASE);
+    }
+
+    if (address == SYSCFG_BASE) {
+        return &syscfg_cfgr1;
+    }
+
+    model_fail("access to an unknown register");
+    return NULL;
+}
+
+static const struct
+{
+    uint8_t irqn;
+    bool (*raised)(void);
+    void (*handler)(void);
+} interrupts[] = {
+    {NVIC_DMA1_CHANNEL2_3_IRQ, dma_model_irq, dma1_channel2_3_isr},
+    {NVIC_I2C1_IRQ, i2c_model_irq, i2c1_isr},
+    {NVIC_USB_IRQ, usb_model_irq, usb_isr}
+};
+
+#define MAX_INTERRUPT_RUNS 1000
+
+// The lines are level triggered, a handler runs as long as its line is
+// raised and unmasked, which makes clearing the pending state a no-op
+void nvic_model_dispatch(void)
+{
+    static bool dispatching = false;
+
+    if (dispatching) {
+        return;
+    }
+
+    dispatching = true;
+
+    for (unsigned runs = 0; ; runs++) {
+        bool handled = false;
+
+        i2c_model_sync();
+
+        for (size_t index = 0;
+             index < sizeof(interrupts) / sizeof(interrupts[0]);
+             index++) {
+            if (((nvic_enabled >> interrupts[index].irqn) & 1) &&
+                interrupts[index].raised()) {
+                simulation_interrupt(interrupts[index].handler);
+                handled = true;
+                break;
+            }
+        }
+
+        if (!handled) {
+            break;
+        }
+
+        if (runs == MAX_INTERRUPT_RUNS) {
+            model_fail("an interrupt handler never clears its line");
+        }
+    }
+
+    dispatching = false;
+
+    simulation_preempt();
+}
+
+void nvic_model_reset(void)
+{
+    nvic_enabled = 0;
+}
+
+void nvic_enable_irq(uint8_t irqn)
+{
+    nvic_enabled |= 1u << irqn;
+
+    nvic_model_dispatch();
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+    nvic_enabled &= ~(1u << irqn);
+}
+
+void nvic_clear_pending_irq(uint8_t irqn)
+{
+    (void)irqn;
+}
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken)
+{
+    (void)clken;
+}
+
+void rcc_set_i2c_clock_sysclk(uint32_t i2c_peripheral)
+{
+    (void)i2c_peripheral;
+}
+
+void rcc_set_usbclk_source(enum rcc_osc clock)
+{
+    (void)clock;
+}
+
+void crs_autotrim_usb_enable(void)
+{
+}
+
+void gpio_mode_setup(uint32_t port, uint8_t mode, uint8_t pull_up_down,
+                     uint16_t gpios)
+{
+    (void)port;
+    (void)mode;
+    (void)pull_up_down;
+    (void)gpios;
+}
+
+void gpio_set_output_options(uint32_t port, uint8_t type, uint8_t speed,
+                             uint16_t gpios)
+{
+    (void)port;
+    (void)type;
+    (void)speed;
+    (void)gpios;
+}
+
+void gpio_set_af(uint32_t port, uint8_t alternate_function, uint16_t gpios)
+{
+    (void)port;
+    (void)alternate_function;
+    (void)gpios;
+}
+
+void gpio_set(uint32_t port, uint16_t gpios)
+{
+    (void)port;
+    (void)gpios;
+}
+
+void gpio_clear(uint32_t port, uint16_t gpios)
+{
+    (void)port;
+    (void)gpios;
+}
+
+// No target ever holds a line low
+uint16_t gpio_get(uint32_t port, uint16_t gpios)
+{
+    (void)port;
+
+    return gpios;
+}
+
+void i2c_peripheral_enable(uint32_t i2c_peripheral)
+{
+    I2C_CR1(i2c_peripheral) |= I2C_CR1_PE;
+}
+
+void i2c_peripheral_disable(uint32_t i2c_peripheral)
+{
+    I2C_CR1(i2c_peripheral) &= ~I2C_CR1_PE;
+}
+
+void i2c_enable_rxdma(uint32_t i2c_peripheral)
+{
+    I2C_CR1(i2c_peripheral) |= I2C_CR1_RXDMAEN;
+}
+
+void i2c_enable_txdma(uint32_t i2c_peripheral)
+{
+    I2C_CR1(i2c_peripheral) |= I2C_CR1_TXDMAEN;
+}
+
+void i2c_enable_interrupt(uint32_t i2c_peripheral, uint32_t interrupt)
+{
+    I2C_CR1(i2c_peripheral) |= interrupt;
+}
+
+void i2c_set_7bit_addr_mode(uint32_t i2c_peripheral)
+{
+    I2C_CR2(i2c_peripheral) &= ~I2C_CR2_ADD10;
+}
+
+void i2c_set_7bit_address(uint32_t i2c_peripheral, uint8_t address)
+{
+    I2C_CR2(i2c_peripheral) =
+        (I2C_CR2(i2c_peripheral) & ~I2C_CR2_SADD_7BIT_MASK) |
+        ((uint32_t)(address & 0x7f) << I2C_CR2_SADD_7BIT_SHIFT);
+}
+
+void i2c_set_write_transfer_dir(uint32_t i2c_peripheral)
+{
+    I2C_CR2(i2c_peripheral) &= ~I2C_CR2_RD_WRN;
+}
+
+void i2c_set_read_transfer_dir(uint32_t i2c_peripheral)
+{
+    I2C_CR2(i2c_peripheral) |= I2C_CR2_RD_WRN;
+}
+
+void i2c_send_start(uint32_t i2c_peripheral)
+{
+    I2C_CR2(i2c_peripheral) |= I2C_CR2_START;
+}
+
+void i2c_send_stop(uint32_t i2c_peripheral)
+{
+    I2C_CR2(i2c_peripheral) |= I2C_CR2_STOP;
+}
+
+bool i2c_transfer_complete(uint32_t i2c_peripheral)
+{
+    return (I2C_ISR(i2c_peripheral) & I2C_ISR_TC) != 0;
+}
+
+bool i2c_nack(uint32_t i2c_peripheral)
+{
+    return (I2C_ISR(i2c_peripheral) & I2C_ISR_NACKF) != 0;
+}
+
+void dma_enable_channel(uint32_t dma_peripheral, uint8_t channel)
+{
+    DMA_CCR(dma_peripheral, channel) |= DMA_CCR_EN;
+}
+
+void dma_disable_channel(uint32_t dma_peripheral, uint8_t channel)
+{
+    DMA_CCR(dma_peripheral, channel) &= ~DMA_CCR_EN;
+}
+
+void dma_set_memory_address(uint32_t dma_peripheral, uint8_t channel,
+                            uint32_t address)
+{
+    if ((DMA_CCR(dma_peripheral, channel) & DMA_CCR_EN) == 0) {
+        DMA_CMAR(dma_peripheral, channel) = address;
+    }
+}
+
+void dma_set_number_of_data(uint32_t dma_peripheral, uint8_t channel,
+                            uint16_t number)
+{
+    DMA_CNDTR(dma_peripheral, channel) = number;
+}
+
+bool dma_get_interrupt_flag(uint32_t dma_peripheral, uint8_t channel,
+                            uint32_t flag)
+{
+    return (DMA_ISR(dma_peripheral) &
+            (flag << DMA_FLAG_OFFSET(channel))) != 0;
+}
+
+void dma_clear_interrupt_flags(uint32_t dma_peripheral, uint8_t channel,
+                               uint32_t flags)
+{
+    DMA_IFCR(dma_peripheral) = flags << DMA_FLAG_OFFSET(channel);
+}
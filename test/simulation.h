@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Shared by the parts of the host build. The scheduler in freertos.c runs
+ * the tasks until all of them wait and then moves the simulated time to
+ * the next event of a peripheral model or the next task timeout. Time only
+ * passes while every task waits, so the firmware takes no CPU time.
+ */
+
+#define SIMULATION_NEVER UINT64_MAX
+
+#define NANOSECONDS_PER_TICK 1000000
+
+// Simulated time in nanoseconds
+extern uint64_t simulation_time;
+
+// Runs the function as the lowest priority task until it returns
+void simulation_start(void (*function)(void));
+
+// Forgets every task but the calling one
+void simulation_reset(void);
+
+// Waits until no other task can run and the models are idle, letting up
+// to the given number of task timeouts pass on the way
+void simulation_wait_idle(unsigned timeouts);
+
+// Waits until the simulated time has come
+void simulation_sleep_until(uint64_t time);
+
+void simulation_delete_task(void *task);
+
+// Runs an interrupt handler, the tasks it readies wait for the preemption
+void simulation_interrupt(void (*handler)(void));
+
+// Gives the processor to a task with a higher priority that became ready
+void simulation_preempt(void);
+
+// Runs the interrupt handlers whose lines are raised and unmasked
+void nvic_model_dispatch(void);
+
+void nvic_model_reset(void);
+
+void i2c_model_reset(void);
+
+// Applies the side effects of register writes made since the last call
+void i2c_model_sync(void);
+
+uint64_t i2c_model_next_event(void);
+
+void i2c_model_run(void);
+
+bool i2c_model_irq(void);
+
+bool dma_model_irq(void);
+
+void usb_model_reset(void);
+
+uint64_t usb_model_next_event(void);
+
+void usb_model_run(void);
+
+bool usb_model_irq(void);
+
+volatile uint32_t *usb_model_register(uint32_t offset);
+
+void usb_model_send(const uint8_t *data, size_t length, size_t packet_length);
+
+const uint8_t *usb_model_output(size_t *length);
+
+void usb_model_clear_output(void);
@@ -0,0 +1,107 @@
+#include "stubs.h"
+#include "simulation.h"
+
+#include <string.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <libopencm3/stm32/flash.h>
+
+#include "usb.h"
+#include "i2c.h"
+
+// Set by clock_setup() on the device
+uint32_t system_core_clock = HOST_CLOCK;
+
+// Placed by the linker at _macro_start, see the Makefile
+uint8_t host_macro_page[1024];
+
+void host_start(void (*function)(void))
+{
+    simulation_start(function);
+}
+
+void host_reset(void)
+{
+    simulation_reset();
+    simulation_time = 0;
+
+    nvic_model_reset();
+    i2c_model_reset();
+    usb_model_reset();
+
+    memset(host_macro_page, 0xff, sizeof(host_macro_page));
+
+    usb_init();
+    i2c_init();
+
+    // Let the host configure the device before anything is sent
+    simulation_wait_idle(0);
+}
+
+uint64_t host_time(void)
+{
+    return simulation_time;
+}
+
+const uint8_t *host_output(size_t *length)
+{
+    simulation_wait_idle(0);
+
+    return usb_model_output(length);
+}
+
+void host_run(void (*task)(void *parameter),
+              const uint8_t *data, size_t length, size_t packet_length)
+{
+    static StaticTask_t task_data;
+    static StackType_t task_stack[configMINIMAL_STACK_SIZE * 2];
+
+    usb_model_send(data, length, packet_length);
+
+    TaskHandle_t handle = xTaskCreateStatic(task, "Shell",
+                                            sizeof(task_stack) /
+                                            sizeof(StackType_t),
+                                            NULL, 1, task_stack, &task_data);
+
+    simulation_wait_idle(1);
+    simulation_delete_task(handle);
+}
+
+void host_clear_output(void)
+{
+    simulation_wait_idle(0);
+
+    usb_model_clear_output();
+}
+
+void host_advance_ticks(uint32_t count)
+{
+    simulation_sleep_until(((uint64_t)xTaskGetTickCount() + count) *
+                           NANOSECONDS_PER_TICK);
+}
+
+void flash_unlock(void)
+{
+}
+
+void flash_lock(void)
+{
+}
+
+void flash_erase_page(uint32_t page_address)
+{
+    (void)page_address;
+
+    memset(host_macro_page, 0xff, sizeof(host_macro_page));
+}
+
+void flash_program_half_word(uint32_t address, uint16_t data)
+{
+    uint8_t *target = (uint8_t *)(uintptr_t)address;
+
+    // Programming can only clear bits
+    target[0] &= (uint8_t)data;
+    target[1] &= (uint8_t)(data >> 8);
+}
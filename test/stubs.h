@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The host build runs the application sources, the I2C and USB drivers
+ * included, on a simulated scheduler and simulated peripherals, see
+ * simulation.h. The bus holds targets with 256 registers and an
+ * auto-incremented register pointer set by the first byte written, like a
+ * small EEPROM. host_registers() gives the whole memory of a target.
+ */
+
+// Clock the peripherals run on, as on the device
+#define HOST_CLOCK 48000000
+
+// Runs the function as a task, everything below is called from within it
+void host_start(void (*function)(void));
+
+// Resets the peripherals and the simulated time and starts the drivers
+void host_reset(void);
+
+// Simulated nanoseconds since the reset
+uint64_t host_time(void);
+
+void host_add_target(uint8_t address);
+
+// A target addressed with one or two bytes whose writes wrap around within
+// pages of page_size bytes, a power of two, or not at all if it is zero.
+// Only one target at a time can take two address bytes.
+void host_add_eeprom(uint8_t address, uint8_t address_width,
+                     uint16_t page_size);
+
+// The target stops answering, host_add_target() brings it back
+void host_remove_target(uint8_t address);
+
+uint8_t *host_registers(uint8_t address);
+
+// Fails the reads and block reads of checked transfers with a PEC mismatch
+void host_fail_pec(bool fail);
+
+// Runs the shell task on the input, received in packets of at most
+// packet_length bytes, until it waits for more. The first wait without
+// input lets its whole timeout pass.
+void host_run(void (*task)(void *parameter),
+              const uint8_t *input, size_t length, size_t packet_length);
+
+// Everything the device sent since the output was cleared, once nothing
+// is left to do without more input or time passing
+const uint8_t *host_output(size_t *length);
+
+void host_clear_output(void);
+
+void host_advance_ticks(uint32_t ticks);
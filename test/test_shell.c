@@ -0,0 +1,925 @@
+// The shell is included whole so that its static helpers can be tested
+#include "../application/src/shell.c"
+
+#include <stdio.h>
+
+#include "stubs.h"
+
+static unsigned failures = 0;
+
+#define CHECK(condition) \
+    check((condition), #condition, __FILE__, __LINE__)
+
+static void check(bool condition, const char *text, const char *file, int line)
+{
+    if (!condition) {
+        printf("%s:%d: check failed: %s\n", file, line, text);
+        failures++;
+    }
+}
+
+static char line_buffer[MAX_COMMAND_LENGTH + 1];
+
+// Runs a text command the way the shell task does and returns the answer
+static const char *run_text(const char *command)
+{
+    host_clear_output();
+
+    strcpy(line_buffer, command);
+
+    if (macro_recording) {
+        shell_record_line(line_buffer);
+    } else {
+        shell_process_command(line_buffer);
+        shell_run_pending_macro();
+    }
+
+    shell_finish_transfers();
+
+    size_t length;
+    return (const char *)host_output(&length);
+}
+
+static void check_text(const char *command, const char *answer,
+                       const char *file, int line)
+{
+    const char *output = run_text(command);
+
+    if (strcmp(output, answer) != 0) {
+        printf("%s:%d: %s answered \"%s\"\n", file, line, command, output);
+        failures++;
+    }
+}
+
+#define CHECK_TEXT(command, answer) \
+    check_text((command), (answer), __FILE__, __LINE__)
+
+// Runs a frame body and compares everything sent with the expected frames
+static bool frame_answers(const uint8_t *body, size_t body_length,
+                          const uint8_t *answer, size_t answer_length)
+{
+    host_clear_output();
+
+    shell_process_frame(body, body_length);
+    shell_run_pending_macro();
+    shell_finish_transfers();
+
+    size_t length;
+    const uint8_t *output = host_output(&length);
+
+    return (length == answer_length) &&
+           (memcmp(output, answer, length) == 0);
+}
+
+#define CHECK_FRAME(body, answer) \
+    check(frame_answers((const uint8_t *)(body), sizeof(body) - 1, \
+                        (const uint8_t *)(answer), sizeof(answer) - 1), \
+          #body " -> " #answer, __FILE__, __LINE__)
+
+// Feeds raw input to the shell task and compares everything sent
+static void check_input(const char *input, size_t length, size_t packet_length,
+                        const char *answer, size_t answer_length,
+                        const char *file, int line)
+{
+    host_clear_output();
+
+    host_run(shell_task, (const uint8_t *)input, length, packet_length);
+
+    size_t output_length;
+    const uint8_t *output = host_output(&output_length);
+
+    if ((output_length != answer_length) ||
+        (memcmp(output, answer, answer_length) != 0)) {
+        printf("%s:%d: unexpected answer to input \"%s\": \"%.*s\"\n",
+               file, line, input, (int)output_length, output);
+        failures++;
+    }
+}
+
+#define CHECK_INPUT(input, packet_length, answer) \
+    check_input((input), sizeof(input) - 1, (packet_length), \
+                (answer), sizeof(answer) - 1, __FILE__, __LINE__)
+
+static void setup(void)
+{
+    host_reset();
+
+    binary_mode = false;
+    compression = false;
+    previous_read.valid = false;
+    memset(jobs, 0, sizeof(jobs));
+
+    host_add_target(0x50);
+    host_add_target(0x68);
+
+    for (unsigned index = 0; index < 256; index++) {
+        host_registers(0x50)[index] = (uint8_t)index;
+    }
+}
+
+static void test_write_hex(void)
+{
+    uint8_t data[16];
+    char string[4 + 2 * sizeof(data) + 1];
+    char expected[2 * sizeof(data) + 1];
+
+    for (size_t index = 0; index < sizeof(data); index++) {
+        data[index] = (uint8_t)(0x5a + 37 * index);
+    }
+
+    // Every alignment of the string and every length up to a few words
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t length = 0; length <= sizeof(data); length++) {
+            for (size_t index = 0; index < length; index++) {
+                sprintf(&expected[index * 2], "%02x", data[index]);
+            }
+            expected[length * 2] = '\0';
+
+            CHECK(write_hex(data, &string[offset], length));
+            CHECK(strcmp(&string[offset], expected) == 0);
+        }
+    }
+
+    for (unsigned value = 0; value < 256; value++) {
+        uint8_t byte = (uint8_t)value;
+
+        sprintf(expected, "%02x", value);
+
+        CHECK(write_hex(&byte, string, 1));
+        CHECK(strcmp(string, expected) == 0);
+    }
+}
+
+static void test_read_hex(void)
+{
+    char string[3];
+    uint8_t byte;
+
+    for (unsigned value = 0; value < 256; value++) {
+        sprintf(string, "%02x", value);
+        CHECK(read_hex(string, &byte, 1) && (byte == value));
+
+        sprintf(string, "%02X", value);
+        CHECK(read_hex(string, &byte, 1) && (byte == value));
+
+        CHECK(read_hex_u8(string) == (int)value);
+    }
+
+    // Any character other than a hex digit, in either position
+    for (unsigned character = 0; character < 256; character++) {
+        if (strchr("0123456789abcdefABCDEF", (int)character) &&
+            (character != 0)) {
+            continue;
+        }
+
+        string[0] = '0';
+        string[1] = (char)character;
+        CHECK(!read_hex(string, &byte, 1));
+
+        string[0] = (char)character;
+        string[1] = '0';
+        CHECK(!read_hex(string, &byte, 1));
+    }
+
+    // Every alignment and length, with a bad digit in every place
+    char digits[4 + 32 + 1];
+    uint8_t expected[16];
+    uint8_t decoded[16];
+
+    for (size_t index = 0; index < sizeof(expected); index++) {
+        expected[index] = (uint8_t)(0xa5 + 29 * index);
+    }
+
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t length = 0; length <= sizeof(expected); length++) {
+            write_hex(expected, &digits[offset], length);
+
+            CHECK(read_hex(&digits[offset], decoded, length));
+            CHECK(memcmp(decoded, expected, length) == 0);
+
+            for (size_t place = 0; place < length * 2; place++) {
+                char digit = digits[offset + place];
+
+                digits[offset + place] = 'x';
+                CHECK(!read_hex(&digits[offset], decoded, length));
+                digits[offset + place] = digit;
+            }
+        }
+    }
+
+    uint8_t data[8];
+    CHECK(read_hex("0123456789abCDef", data, 8));
+    CHECK(memcmp(data, "\x01\x23\x45\x67\x89\xab\xcd\xef", 8) == 0);
+    CHECK(!read_hex("0123456789abCDeg", data, 8));
+    CHECK(!read_hex("0123 56789abcdef", data, 8));
+}
+
+static void test_decimal(void)
+{
+    CHECK(read_u16("0") == 0);
+    CHECK(read_u16("65535") == 65535);
+    CHECK(read_u16("65536") == -1);
+    CHECK(read_u16("99999999999") == -1);
+    CHECK(read_u16("12a") == -1);
+    CHECK(read_u16("-1") == -1);
+    CHECK(read_decimal("65536", MAX_READ_LENGTH) == 65536);
+    CHECK(read_decimal("65537", MAX_READ_LENGTH) == -1);
+
+    char string[6];
+
+    for (uint32_t value = 0; value <= UINT16_MAX; value += 257) {
+        size_t length = write_u16((uint16_t)value, string);
+
+        CHECK(length == strlen(string));
+        CHECK(read_u16(string) == (int)value);
+    }
+}
+
+// Undoes rle_encode(), returns the decoded length or -1 if malformed
+static int rle_decode(const uint8_t *data, size_t length,
+                      uint8_t *output, size_t limit)
+{
+    size_t position = 0;
+    size_t output_length = 0;
+
+    while (position < length) {
+        uint8_t control = data[position++];
+        size_t count;
+
+        if (control < RUN_FLAG) {
+            count = control + 1u;
+            if ((length - position < count) ||
+                (limit - output_length < count)) {
+                return -1;
+            }
+            memcpy(&output[output_length], &data[position], count);
+            position += count;
+        } else {
+            count = control - RUN_FLAG + MIN_RUN_LENGTH;
+            if ((position == length) || (limit - output_length < count)) {
+                return -1;
+            }
+            memset(&output[output_length], data[position++], count);
+        }
+
+        output_length += count;
+    }
+
+    return (int)output_length;
+}
+
+// Undoes encode_data() given the data the delta was taken against
+static int decode_data_encoding(const uint8_t *data, size_t length,
+                                const uint8_t *previous, uint8_t *output)
+{
+    if (length == 0) {
+        return -1;
+    }
+
+    switch (data[0]) {
+    case ENCODING_RAW:
+        memcpy(output, &data[1], length - 1);
+        return (int)length - 1;
+
+    case ENCODING_RLE:
+        return rle_decode(&data[1], length - 1, output, MAX_DATA_LENGTH);
+
+    case ENCODING_DELTA: {
+        int decoded = rle_decode(&data[1], length - 1,
+                                 output, MAX_DATA_LENGTH);
+
+        for (int position = 0; previous && (position < decoded); position++) {
+            output[position] ^= previous[position];
+        }
+
+        return previous ? decoded : -1;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+static void fill_pattern(uint8_t *data, size_t length, unsigned pattern)
+{
+    uint32_t state = pattern * 2654435761u + 1;
+
+    for (size_t position = 0; position < length; position++) {
+        state = state * 1103515245u + 12345;
+
+        switch (pattern % 4) {
+        case 0:
+            data[position] = (uint8_t)(state >> 16);
+            break;
+        case 1:
+            data[position] = 0;
+            break;
+        case 2:
+            // Runs of every length up to a few past the longest one
+            data[position] = (uint8_t)((position / (pattern % 137 + 1)) & 1);
+            break;
+        default:
+            // Mostly runs, broken up by short literals
+            data[position] = ((state >> 16) % 5 == 0) ?
+                             (uint8_t)(state >> 8) : 0x55;
+            break;
+        }
+    }
+}
+
+static void test_compression(void)
+{
+    uint8_t data[300];
+    uint8_t previous[300];
+    uint8_t encoded[2 * sizeof(data)];
+    uint8_t decoded[sizeof(data)];
+
+    // Runs and literals longer than one packet holds
+    for (unsigned pattern = 0; pattern < 400; pattern++) {
+        size_t length = pattern % (sizeof(data) + 1);
+
+        fill_pattern(data, length, pattern);
+        fill_pattern(previous, length, pattern + 1);
+
+        struct rle_output output = {encoded, 0, sizeof(encoded)};
+
+        CHECK(rle_encode(&output, data, NULL, length));
+        CHECK(rle_decode(encoded, output.length, decoded, sizeof(decoded)) ==
+              (int)length);
+        CHECK(memcmp(decoded, data, length) == 0);
+
+        CHECK(rle_encode(&output, data, previous, length));
+        int delta_length = rle_decode(encoded, output.length,
+                                      decoded, sizeof(decoded));
+        CHECK(delta_length == (int)length);
+        for (size_t position = 0; position < length; position++) {
+            CHECK((decoded[position] ^ previous[position]) == data[position]);
+        }
+
+        // An output too small to hold the encoding is refused
+        if (output.length > 0) {
+            struct rle_output small = {encoded, 0, output.length - 1};
+            CHECK(!rle_encode(&small, data, previous, length));
+        }
+    }
+
+    // encode_data() picks the shortest encoding, raw if nothing pays off
+    for (unsigned pattern = 0; pattern < 200; pattern++) {
+        size_t length = pattern % (MAX_DATA_LENGTH + 1);
+
+        fill_pattern(data, length, pattern);
+        fill_pattern(previous, length, pattern / 2);
+
+        size_t encoded_length = encode_data(data, NULL, length);
+        CHECK(encoded_length <= length + 1);
+        CHECK(encode_buffer[0] != ENCODING_DELTA);
+        CHECK(decode_data_encoding(encode_buffer, encoded_length,
+                                   NULL, decoded) == (int)length);
+        CHECK(memcmp(decoded, data, length) == 0);
+
+        encoded_length = encode_data(data, previous, length);
+        CHECK(encoded_length <= length + 1);
+        CHECK(decode_data_encoding(encode_buffer, encoded_length,
+                                   previous, decoded) == (int)length);
+        CHECK(memcmp(decoded, data, length) == 0);
+    }
+
+    memset(data, 0x3c, 64);
+    CHECK(encode_data(data, NULL, 64) == 3);
+    CHECK(memcmp(encode_buffer, "\x01\xbd\x3c", 3) == 0);
+    CHECK(encode_data(data, data, 64) == 3);
+    CHECK(memcmp(encode_buffer, "\x02\xbd\x00", 3) == 0);
+    CHECK(encode_data((const uint8_t *)"\x01\x02", NULL, 2) == 3);
+    CHECK(memcmp(encode_buffer, "\x00\x01\x02", 3) == 0);
+}
+
+static void test_command_lookup(void)
+{
+    for (size_t opcode = 0; opcode < COMMAND_COUNT; opcode++) {
+        const struct shell_command *command = &commands[opcode];
+
+        CHECK(command->name != NULL);
+        CHECK(find_command_by_name(command->name) == command);
+        CHECK(find_command_by_opcode((uint8_t)opcode) == command);
+    }
+
+    CHECK(find_command_by_name("") == NULL);
+    CHECK(find_command_by_name("read") == NULL);
+    CHECK(find_command_by_name("READX") == NULL);
+    CHECK(find_command_by_name("REA") == NULL);
+    CHECK(find_command_by_name("ZAP") == NULL);
+    CHECK(find_command_by_name("_READ") == NULL);
+    CHECK(find_command_by_opcode((uint8_t)COMMAND_COUNT) == NULL);
+    CHECK(find_command_by_opcode(BINARY_OPCODE_MASK) == NULL);
+}
+
+static void test_text_commands(void)
+{
+    setup();
+
+    CHECK_TEXT("PING", "OK\r\n");
+    CHECK_TEXT("#7 PING", "#7 OK\r\n");
+    CHECK_TEXT("#65535 PING", "#65535 OK\r\n");
+    CHECK_TEXT("#65536 PING", "ERROR\r\n");
+    CHECK_TEXT("# PING", "ERROR\r\n");
+    CHECK_TEXT("PONG", "ERROR\r\n");
+    CHECK_TEXT("", "ERROR\r\n");
+
+    CHECK_TEXT("READ 50 4", "DATA 00010203\r\n");
+    CHECK_TEXT("WRITE 50 3 10aabb", "OK\r\n");
+    CHECK_TEXT("WRITE_READ 50 1 10 2", "DATA aabb\r\n");
+
+    // The repeated START makes the target take the second part as a write
+    // of its own, starting with a register address
+    CHECK_TEXT("WRITE_WRITE 50 1 20 2 21dd", "OK\r\n");
+    CHECK_TEXT("WRITE_READ 50 1 20 2", "DATA 20dd\r\n");
+    CHECK_TEXT("#3 WRITE_READ 50 1 21 1", "#3 DATA dd\r\n");
+
+    // Malformed and failing commands
+    CHECK_TEXT("READ 50", "ERROR\r\n");
+    CHECK_TEXT("READ 50 4 5", "ERROR\r\n");
+    CHECK_TEXT("READ 80 1", "ERROR\r\n");
+    CHECK_TEXT("READ 5 1", "ERROR\r\n");
+    CHECK_TEXT("READ 51 1", "ERROR\r\n");
+    CHECK_TEXT("WRITE 50 2 10", "ERROR\r\n");
+    CHECK_TEXT("WRITE 50 1 1g", "ERROR\r\n");
+    CHECK_TEXT("WRITE 51 1 10", "ERROR\r\n");
+
+    // PEC mismatches are told apart from other failures
+    CHECK_TEXT("WRITE_READ_PEC 50 1 20 1", "DATA 20\r\n");
+    host_fail_pec(true);
+    CHECK_TEXT("READ_PEC 50 1", "PEC_ERROR\r\n");
+    CHECK_TEXT("WRITE_READ 50 1 21 1", "DATA dd\r\n");
+    CHECK_TEXT("BLOCK_READ_PEC 68 1 00", "ERROR\r\n");
+    host_fail_pec(false);
+
+    // The block length comes from the first register read
+    host_registers(0x68)[0x40] = 2;
+    host_registers(0x68)[0x41] = 0x12;
+    host_registers(0x68)[0x42] = 0x34;
+    CHECK_TEXT("BLOCK_READ 68 1 40", "DATA 1234\r\n");
+    CHECK_TEXT("BLOCK_READ_PEC 68 1 40", "DATA 1234\r\n");
+
+    CHECK_TEXT("BATCH WRITE 50 2 3033 WRITE_READ 50 1 30 2",
+               "BATCH OK 3331\r\n");
+    CHECK_TEXT("BATCH READ 51 1 WRITE_READ 50 1 40 1",
+               "BATCH ERROR 40\r\n");
+    CHECK_TEXT("BATCH STOP READ 51 1 READ 50 1", "BATCH ERROR\r\n");
+    CHECK_TEXT("BATCH READ 50 1 READ 50", "ERROR\r\n");
+    CHECK_TEXT("BATCH", "ERROR\r\n");
+
+    CHECK_TEXT("SCAN", "DATA 00000000000000000000010000010000\r\n");
+
+    CHECK_TEXT("SPEED 400", "DATA 801a0600\r\n");
+    CHECK_TEXT("SPEED 0", "ERROR\r\n");
+    CHECK_TEXT("SPEED 2000", "ERROR\r\n");
+}
+
+static void test_macros(void)
+{
+    setup();
+
+    CHECK_TEXT("MACRO 1", "ERROR\r\n");
+    CHECK_TEXT("MACRO_BEGIN 1", "OK\r\n");
+    CHECK_TEXT("WRITE_READ 50 1 7f 1", "OK\r\n");
+    CHECK_TEXT("WRITE 50 2 7077", "OK\r\n");
+    CHECK_TEXT("MACRO_END", "OK\r\n");
+    CHECK_TEXT("MACRO_BEGIN 2", "OK\r\n");
+    CHECK_TEXT("READ 51 1", "OK\r\n");
+    CHECK_TEXT("MACRO_END", "OK\r\n");
+
+    // The answers of the commands in a macro are left out
+    CHECK_TEXT("MACRO 1", "OK\r\n");
+    CHECK(host_registers(0x50)[0x70] == 0x77);
+    CHECK_TEXT("#9 MACRO 1", "#9 OK\r\n");
+    CHECK_TEXT("MACRO 2", "ERROR\r\n");
+
+    // MACRO_END is recognised however it is spaced or tagged
+    CHECK_TEXT("MACRO_BEGIN 3", "OK\r\n");
+    CHECK_TEXT("WRITE 50 2 7188", "OK\r\n");
+    CHECK_TEXT("  MACRO_END ", "OK\r\n");
+    CHECK(!macro_recording);
+    CHECK_TEXT("MACRO_BEGIN 4", "OK\r\n");
+    CHECK_TEXT("#5 MACRO_END", "#5 OK\r\n");
+    CHECK(!macro_recording);
+    CHECK_TEXT("MACRO 3", "OK\r\n");
+    CHECK(host_registers(0x50)[0x71] == 0x88);
+
+    CHECK_TEXT("MACRO_ERASE", "OK\r\n");
+    CHECK_TEXT("MACRO 1", "ERROR\r\n");
+}
+
+// Lets the ticks pass, runs the jobs that are due and compares the events
+// they sent and the wait for the next one
+static void check_jobs(uint32_t ticks,
+                       const char *events, size_t events_length,
+                       TickType_t timeout, const char *file, int line)
+{
+    host_advance_ticks(ticks);
+    host_clear_output();
+
+    TickType_t next = shell_run_jobs();
+
+    size_t length;
+    const uint8_t *output = host_output(&length);
+
+    if ((length != events_length) ||
+        (memcmp(output, events, length) != 0) || (next != timeout)) {
+        printf("%s:%d: jobs sent \"%.*s\", next in %lu\n",
+               file, line, (int)length, output, (unsigned long)next);
+        failures++;
+    }
+}
+
+#define CHECK_JOBS(ticks, events, timeout) \
+    check_jobs((ticks), (events), sizeof(events) - 1, (timeout), \
+               __FILE__, __LINE__)
+
+static void test_sample(void)
+{
+    setup();
+
+    CHECK_JOBS(0, "", portMAX_DELAY);
+
+    // The first sample is due at once, the next ones on a fixed grid
+    CHECK_TEXT("SAMPLE 50 1 10 2 100", "DATA 00\r\n");
+    CHECK_JOBS(0, "SAMPLE 00 00000000 1011\r\n", 100);
+    CHECK_JOBS(40, "", 60);
+    CHECK_JOBS(60, "SAMPLE 00 00000064 1011\r\n", 100);
+    host_registers(0x50)[0x11] = 0x99;
+    CHECK_JOBS(99, "", 1);
+    CHECK_JOBS(1, "SAMPLE 00 000000c8 1099\r\n", 100);
+
+    // Missed samples are skipped rather than sent late
+    CHECK_JOBS(350, "SAMPLE 00 00000226 1099\r\n", 100);
+
+    // Tagged jobs tag their events, failed reads are reported
+    CHECK_TEXT("#7 SAMPLE 68 1 00 1 30", "#7 DATA 01\r\n");
+    CHECK_TEXT("SAMPLE 51 2 0102 1 1000", "DATA 02\r\n");
+    CHECK_JOBS(0, "#7 SAMPLE 01 00000226 00\r\n"
+                  "SAMPLE 02 00000226 ERROR\r\n", 30);
+    CHECK_JOBS(30, "#7 SAMPLE 01 00000244 00\r\n", 30);
+
+    // Four slots, bad periods and lengths
+    CHECK_TEXT("SAMPLE 68 1 00 64 5", "DATA 03\r\n");
+    CHECK_TEXT("SAMPLE 68 1 00 1 5", "ERROR\r\n");
+    CHECK_TEXT("CANCEL 3", "OK\r\n");
+    CHECK_TEXT("SAMPLE 68 1 00 1 0", "ERROR\r\n");
+    CHECK_TEXT("SAMPLE 68 1 00 65 5", "ERROR\r\n");
+    CHECK_TEXT("SAMPLE 68 5 0001020304 1 5", "ERROR\r\n");
+
+    CHECK_TEXT("CANCEL 1", "OK\r\n");
+    CHECK_TEXT("CANCEL 1", "ERROR\r\n");
+    CHECK_TEXT("CANCEL 4", "ERROR\r\n");
+    CHECK_TEXT("#2 CANCEL 0", "#2 OK\r\n");
+    CHECK_JOBS(0, "", 1000 - 30);
+    CHECK_TEXT("CANCEL 2", "OK\r\n");
+    CHECK_JOBS(1000, "", portMAX_DELAY);
+
+    // The shell task runs the jobs while it waits for commands
+    CHECK_INPUT("SAMPLE 50 1 10 1 100\n", 64,
+                "DATA 00\r\n"
+                "SAMPLE 00 0000062c 10\r\n"
+                "SAMPLE 00 00000690 10\r\n");
+    CHECK_TEXT("CANCEL 0", "OK\r\n");
+
+    // Frames carry the slot, the tick count and the data
+    CHECK_TEXT("BINARY", "OK\r\n");
+    CHECK_FRAME("\x88\x05\x00\x50\x01\x00\x10\x02\x00\x0a\x00",
+                "\x04\x80\x05\x00\x00");
+    CHECK_JOBS(0, "\x0a\x82\x05\x00\x00\x90\x06\x00\x00\x10\x99", 10);
+    CHECK_FRAME("\x08\x51\x01\x00\x10\x01\x00\x0a\x00", "\x02\x00\x01");
+    CHECK_JOBS(10, "\x0a\x82\x05\x00\x00\x9a\x06\x00\x00\x10\x99"
+                   "\x06\x02\x01\x9a\x06\x00\x00", 10);
+    CHECK_FRAME("\x09\x01\x00", "\x01\x00");
+    CHECK_FRAME("\x09\x01\x00", "\x01\x01");
+    CHECK_FRAME("\x07", "\x01\x00");
+    CHECK_TEXT("CANCEL 0", "OK\r\n");
+
+    // Samples short enough are delta encoded against the last one, if
+    // that pays off
+    CHECK_TEXT("COMPRESS 1", "OK\r\n");
+    CHECK_TEXT("SAMPLE 50 1 10 4 10", "DATA 0000\r\n");
+    CHECK_JOBS(0, "SAMPLE 00 0000069a 0010991213\r\n", 10);
+    CHECK_JOBS(10, "SAMPLE 00 000006a4 028100\r\n", 10);
+    host_registers(0x50)[0x12] = 0x00;
+    CHECK_JOBS(10, "SAMPLE 00 000006ae 0010990013\r\n", 10);
+}
+
+static void test_watch(void)
+{
+    setup();
+
+    host_registers(0x50)[0x20] = 0x12;
+    host_registers(0x50)[0x21] = 0x34;
+
+    // Reported at once, then only when the bits under the mask change
+    CHECK_TEXT("WATCH 50 1 20 2 10 ff0f", "DATA 00\r\n");
+    CHECK_JOBS(0, "WATCH 00 00000000 1234\r\n", 10);
+    CHECK_JOBS(10, "", 10);
+    host_registers(0x50)[0x21] = 0xc4;
+    CHECK_JOBS(10, "", 10);
+    host_registers(0x50)[0x21] = 0xc5;
+    CHECK_JOBS(10, "WATCH 00 0000001e 12c5\r\n", 10);
+    host_registers(0x50)[0x20] = 0x13;
+    CHECK_JOBS(10, "WATCH 00 00000028 13c5\r\n", 10);
+
+    // A failing read is reported once, and so is its recovery even
+    // without a change in the data
+    host_remove_target(0x50);
+    CHECK_JOBS(10, "WATCH 00 00000032 ERROR\r\n", 10);
+    CHECK_JOBS(10, "", 10);
+    host_add_target(0x50);
+    CHECK_JOBS(10, "WATCH 00 00000046 13c5\r\n", 10);
+    CHECK_JOBS(10, "", 10);
+
+    // Without a mask every bit counts, a job failing from the start
+    // reports that
+    CHECK_TEXT("#3 WATCH 68 1 00 1 20", "#3 DATA 01\r\n");
+    CHECK_TEXT("WATCH 51 1 00 1 20", "DATA 02\r\n");
+    CHECK_JOBS(0, "#3 WATCH 01 00000050 00\r\n"
+                  "WATCH 02 00000050 ERROR\r\n", 10);
+    host_registers(0x68)[0x00] = 0x01;
+    CHECK_JOBS(10, "", 10);
+    CHECK_JOBS(10, "#3 WATCH 01 00000064 01\r\n", 10);
+
+    CHECK_TEXT("WATCH 68 1 00 9 20", "ERROR\r\n");
+    CHECK_TEXT("WATCH 68 1 00 2 20 ff", "ERROR\r\n");
+    CHECK_TEXT("WATCH 68 1 00 1 20 ff ff", "ERROR\r\n");
+    CHECK_TEXT("WATCH 68 1 00 1 20 fg", "ERROR\r\n");
+
+    CHECK_TEXT("CANCEL 2", "OK\r\n");
+    CHECK_TEXT("CANCEL 1", "OK\r\n");
+
+    CHECK_TEXT("BINARY", "OK\r\n");
+    host_registers(0x50)[0x21] = 0xc6;
+    CHECK_JOBS(10, "\x08\x03\x00\x6e\x00\x00\x00\x13\xc6", 10);
+    CHECK_FRAME("\x0a\x68\x01\x00\x00\x01\x00\x05\x00\x0f",
+                "\x02\x00\x01");
+    host_registers(0x68)[0x00] = 0xf1;
+    CHECK_JOBS(0, "\x07\x03\x01\x6e\x00\x00\x00\xf1", 5);
+    host_registers(0x68)[0x00] = 0x31;
+    CHECK_JOBS(5, "", 5);
+    CHECK_FRAME("\x07", "\x01\x00");
+}
+
+static void test_compressed_answers(void)
+{
+    setup();
+
+    CHECK_TEXT("COMPRESS 2", "ERROR\r\n");
+    CHECK_TEXT("COMPRESS 1", "OK\r\n");
+
+    // Raw until the same read comes again, then the change is sent
+    CHECK_TEXT("WRITE_READ 50 1 00 8", "DATA 000001020304050607\r\n");
+    CHECK_TEXT("WRITE_READ 50 1 00 8", "DATA 028500\r\n");
+    host_registers(0x50)[0x03] = 0x13;
+    CHECK_TEXT("WRITE_READ 50 1 00 8", "DATA 02800000108100\r\n");
+    CHECK_TEXT("WRITE_READ 50 1 01 7", "DATA 0001021304050607\r\n");
+
+    // Runs are encoded even without an earlier read
+    memset(&host_registers(0x50)[0x80], 0xee, 32);
+    CHECK_TEXT("WRITE_READ 50 1 80 32", "DATA 019dee\r\n");
+
+    // Streamed reads carry the encoding byte in the first chunk only, the
+    // chunks are encoded one by one
+    memset(&host_registers(0x50)[0x00], 0x11, 0x80);
+    CHECK_TEXT("WRITE_READ 50 1 00 128", "DATA 019d119d119d119d11\r\n");
+
+    // BATCH frames are never encoded
+    CHECK_TEXT("BINARY", "OK\r\n");
+    CHECK_FRAME("\x03\x50\x01\x00\x80\x04\x00",
+                "\x04\x00\x01\x81\xee");
+    CHECK_FRAME("\x05\x00\x03\x50\x01\x00\x80\x02\x00",
+                "\x04\x00\x00\xee\xee");
+    CHECK_FRAME("\x0f\x00\x00", "\x01\x00");
+    CHECK_FRAME("\x03\x50\x01\x00\x80\x02\x00", "\x03\x00\xee\xee");
+    CHECK_FRAME("\x07", "\x01\x00");
+}
+
+static void test_eeprom(void)
+{
+    setup();
+
+    // 24C16 style: the upper bits of the memory address pick the block
+    host_add_eeprom(0x54, 1, 16);
+    host_add_eeprom(0x55, 1, 16);
+
+    CHECK_TEXT("EEPROM_WRITE 1 00", "ERROR\r\n");
+    CHECK_TEXT("EEPROM 54 1 fa 16", "OK\r\n");
+    CHECK_TEXT("EEPROM_WRITE 16 000102030405060708090a0b0c0d0e0f",
+               "OK\r\n");
+    CHECK_TEXT("#4 EEPROM_WRITE 2 aabb", "#4 OK\r\n");
+
+    // Split at the page boundary, a page write would have wrapped to 0xf0
+    CHECK(host_registers(0x54)[0xf0] == 0x00);
+    CHECK(host_registers(0x54)[0xfa] == 0x00);
+    CHECK(host_registers(0x54)[0xff] == 0x05);
+    CHECK(host_registers(0x55)[0x00] == 0x06);
+    CHECK(host_registers(0x55)[0x09] == 0x0f);
+    CHECK(host_registers(0x55)[0x0a] == 0xaa);
+    CHECK(host_registers(0x55)[0x0b] == 0xbb);
+
+    // Addresses are hex, and one address byte reaches 0x7ff
+    CHECK_TEXT("EEPROM 54 1 800 16", "ERROR\r\n");
+    CHECK_TEXT("EEPROM 54 1 12345 16", "ERROR\r\n");
+    CHECK_TEXT("EEPROM 54 1 1g 16", "ERROR\r\n");
+    CHECK_TEXT("EEPROM 54 3 10 16", "ERROR\r\n");
+    CHECK_TEXT("EEPROM 54 1 10 0", "ERROR\r\n");
+    CHECK_TEXT("EEPROM 54 1 7fe 16", "OK\r\n");
+    CHECK_TEXT("EEPROM_WRITE 3 010203", "ERROR\r\n");
+    CHECK_TEXT("EEPROM_WRITE 1 01", "ERROR\r\n");
+
+    // A block beyond the last target address
+    CHECK_TEXT("EEPROM 7c 1 7ff 16", "OK\r\n");
+    CHECK_TEXT("EEPROM_WRITE 1 01", "ERROR\r\n");
+
+    // A missing device fails the write and ends the session
+    CHECK_TEXT("EEPROM 54 1 2fe 16", "OK\r\n");
+    CHECK_TEXT("EEPROM_WRITE 1 01", "ERROR\r\n");
+    CHECK_TEXT("EEPROM 54 1 100 16", "OK\r\n");
+    CHECK_TEXT("EEPROM_WRITE 1 cc", "OK\r\n");
+    CHECK(host_registers(0x55)[0x00] == 0xcc);
+
+    // Two address bytes, high byte first
+    host_add_eeprom(0x56, 2, 32);
+
+    CHECK_TEXT("EEPROM 56 2 1f8 32", "OK\r\n");
+    CHECK_TEXT("EEPROM_WRITE 12 101112131415161718191a1b", "OK\r\n");
+    CHECK(host_registers(0x56)[0x1e0] == 0x00);
+    CHECK(host_registers(0x56)[0x1f8] == 0x10);
+    CHECK(host_registers(0x56)[0x1ff] == 0x17);
+    CHECK(host_registers(0x56)[0x200] == 0x18);
+    CHECK(host_registers(0x56)[0x203] == 0x1b);
+    CHECK_TEXT("EEPROM 56 2 ffff 32", "OK\r\n");
+    CHECK_TEXT("EEPROM_WRITE 2 0102", "ERROR\r\n");
+
+    CHECK_TEXT("BINARY", "OK\r\n");
+    CHECK_FRAME("\x11\x56\x02\x00\x00\x10\x20\x00", "\x01\x00");
+    CHECK_FRAME("\x12\x02\x00\xde\xad", "\x01\x00");
+    CHECK(host_registers(0x56)[0x1000] == 0xde);
+    CHECK(host_registers(0x56)[0x1001] == 0xad);
+    CHECK_FRAME("\x07", "\x01\x00");
+}
+
+static void test_input(void)
+{
+    setup();
+
+    static const char overlong[] =
+        "#1 WRITE 50 255 "
+        "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+        "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+        "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+        "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+        "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+        "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+        "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+        "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfe\r\n"
+        "PING\n";
+
+    // Lines split across packets, CRLF and LF endings, blank lines
+    CHECK_INPUT("PING\r\nPING\n\r\n#2 PING\r", 3,
+                "OK\r\nOK\r\n#2 OK\r\n");
+    CHECK_INPUT("WRITE_READ 50 1 10 2\nREAD 51 1\n", 64,
+                "DATA 1011\r\nERROR\r\n");
+    CHECK_INPUT("P\tI\x01NG\n", 64, "OK\r\n");
+    CHECK_INPUT(overlong, 64, "ERROR\r\nOK\r\n");
+
+    CHECK_INPUT("MACRO_BEGIN 3\nPING\nMACRO_END\nMACRO 3\n", 7,
+                "OK\r\nOK\r\nOK\r\nOK\r\n");
+
+    // Frames right after the line switching to them, split or not
+    CHECK_INPUT("BINARY\r\n\x01\x00\x03\x80\x05\x00", 64,
+                "OK\r\n\x01\x00\x03\x80\x05\x00");
+    CHECK_INPUT("\x04\x01\x50\x02\x00\x01\x07PING\n", 1,
+                "\x03\x00\x12\x13\x01\x00OK\r\n");
+}
+
+// Starts a transfer, lets the shell stay busy for a while and answers it
+static const char *run_delayed(const char *command, uint32_t ticks)
+{
+    host_clear_output();
+
+    strcpy(line_buffer, command);
+    shell_process_command(line_buffer);
+
+    host_advance_ticks(ticks);
+    shell_finish_transfers();
+
+    size_t length;
+    return (const char *)host_output(&length);
+}
+
+#if FEATURE_STREAM
+
+static void test_long_read(void)
+{
+    static char expected[sizeof("DATA \r\n") + 2 * 1000];
+
+    setup();
+
+    // Streamed through the send ring of the USB driver twice over
+    strcpy(expected, "DATA ");
+
+    for (unsigned index = 0; index < 1000; index++) {
+        sprintf(&expected[5 + 2 * index], "%02x", index & 0xff);
+    }
+
+    strcat(expected, "\r\n");
+
+    CHECK_TEXT("READ 50 1000", expected);
+}
+
+#endif
+
+static void test_pending_transfers(void)
+{
+    setup();
+
+    // The read after the repeated START does not wait for the shell, which
+    // would have SCL held low for longer than the timeout allows
+    CHECK(strcmp(run_delayed("WRITE_READ 50 1 10 2", 40),
+                 "DATA 1011\r\n") == 0);
+    CHECK(strcmp(run_delayed("WRITE_WRITE 50 1 30 2 3199", 40),
+                 "OK\r\n") == 0);
+    CHECK(host_registers(0x50)[0x31] == 0x99);
+
+    // Each answer follows the start of the next transfer, in order
+    CHECK_INPUT("#1 WRITE_READ 50 1 10 1\n#2 WRITE 50 2 2055\n"
+                "#3 WRITE_READ 50 1 20 1\nREAD 51 1\n", 64,
+                "#1 DATA 10\r\n#2 OK\r\n#3 DATA 55\r\nERROR\r\n");
+
+    // Tagged commands that leave the bus alone overtake the transfer
+    CHECK_INPUT("#1 WRITE_READ 50 1 10 1\n#2 PING\nPING\n", 64,
+                "#2 OK\r\n#1 DATA 10\r\nOK\r\n");
+
+    // A due job waits for the transfer on the bus, not for the host to
+    // stop sending commands, so it samples before being cancelled
+    CHECK_INPUT("#1 WRITE_READ 50 1 10 1\n#2 SAMPLE 50 1 11 1 100\n"
+                "#3 WRITE_READ 50 1 12 1\n#4 WRITE_READ 50 1 13 1\n"
+                "#5 CANCEL 0\n", 24,
+                "#1 DATA 10\r\n#2 DATA 00\r\n#3 DATA 12\r\n#4 DATA 13\r\n"
+                "#2 SAMPLE 00 00000050 11\r\n#5 OK\r\n");
+}
+
+static void test_binary_frames(void)
+{
+    setup();
+
+    CHECK_TEXT("BINARY", "OK\r\n");
+
+    CHECK_FRAME("\x00", "\x01\x00");
+    CHECK_FRAME("\x80\x34\x12", "\x03\x80\x34\x12");
+    CHECK_FRAME("\x01\x50\x03\x00", "\x04\x00\x00\x01\x02");
+    CHECK_FRAME("\x02\x50\x02\x00\x10\xee", "\x01\x00");
+    CHECK_FRAME("\x03\x50\x01\x00\x10\x01\x00", "\x02\x00\xee");
+    CHECK_FRAME("\x83\x01\x00\x50\x01\x00\x10\x01\x00",
+                "\x04\x80\x01\x00\xee");
+
+    // Malformed frames and failing transfers
+    CHECK_FRAME("\x01\x50\x03", "\x01\x01");
+    CHECK_FRAME("\x01\x50\x03\x00\x00", "\x01\x01");
+    CHECK_FRAME("\x01\x51\x01\x00", "\x01\x01");
+    CHECK_FRAME("\x7f", "\x01\x01");
+
+    CHECK_FRAME("\x05\x00\x03\x50\x01\x00\x20\x01\x00\x01\x51\x01\x00",
+                "\x04\x00\x00\x20\x01");
+
+    CHECK_FRAME("\x07", "\x01\x00");
+    CHECK(!binary_mode);
+}
+
+static void run_tests(void)
+{
+    test_write_hex();
+    test_read_hex();
+    test_decimal();
+    test_compression();
+    test_command_lookup();
+    test_text_commands();
+    test_macros();
+    test_sample();
+    test_watch();
+    test_compressed_answers();
+    test_eeprom();
+    test_input();
+    test_pending_transfers();
+#if FEATURE_STREAM
+    test_long_read();
+#endif
+    test_binary_frames();
+}
+
+int main(void)
+{
+    host_start(run_tests);
+
+    if (failures != 0) {
+        printf("%u checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
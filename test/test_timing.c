@@ -0,0 +1,211 @@
+// The timing calculation is included whole to reach its bus mode table
+#include "../application/src/timing.c"
+
+#include <stdio.h>
+
+#include "stubs.h"
+
+static unsigned failures = 0;
+
+#define CHECK(condition) \
+    check((condition), #condition, __FILE__, __LINE__)
+
+static void check(bool condition, const char *text, const char *file, int line)
+{
+    if (!condition) {
+        printf("%s:%d: check failed: %s\n", file, line, text);
+        failures++;
+    }
+}
+
+struct timing_fields
+{
+    uint32_t presc;
+    uint32_t scldel;
+    uint32_t sdadel;
+    uint32_t sclh;
+    uint32_t scll;
+};
+
+static struct timing_fields split_timing(uint32_t timing)
+{
+    struct timing_fields fields = {
+        (timing >> I2C_TIMINGR_PRESC_SHIFT) & 0xf,
+        (timing >> I2C_TIMINGR_SCLDEL_SHIFT) & 0xf,
+        (timing >> I2C_TIMINGR_SDADEL_SHIFT) & 0xf,
+        (timing >> I2C_TIMINGR_SCLH_SHIFT) & 0xff,
+        (timing >> I2C_TIMINGR_SCLL_SHIFT) & 0xff
+    };
+
+    return fields;
+}
+
+// SCL low and high times in clock cycles, edges and synchronisation included
+static uint32_t low_cycles(const struct timing_fields *fields,
+                           uint32_t fall_time)
+{
+    uint32_t clock_mhz = HOST_CLOCK / 1000000;
+
+    return (fields->scll + 1) * (fields->presc + 1) +
+           ns_to_cycles(clock_mhz, fall_time) +
+           ns_to_cycles(clock_mhz, ANALOG_FILTER_DELAY) + SYNC_CYCLES;
+}
+
+static uint32_t high_cycles(const struct timing_fields *fields,
+                            uint32_t rise_time)
+{
+    uint32_t clock_mhz = HOST_CLOCK / 1000000;
+
+    return (fields->sclh + 1) * (fields->presc + 1) +
+           ns_to_cycles(clock_mhz, rise_time) +
+           ns_to_cycles(clock_mhz, ANALOG_FILTER_DELAY) + SYNC_CYCLES;
+}
+
+static const struct bus_mode *find_mode(uint32_t frequency)
+{
+    for (size_t index = 0; index < BUS_MODE_COUNT; index++) {
+        if (frequency <= bus_modes[index].max_frequency) {
+            return &bus_modes[index];
+        }
+    }
+
+    return NULL;
+}
+
+static bool meets_mode(const struct timing_fields *fields,
+                       const struct bus_mode *mode,
+                       uint32_t rise_time, uint32_t fall_time)
+{
+    uint32_t clock_mhz = HOST_CLOCK / 1000000;
+
+    return (low_cycles(fields, fall_time) >=
+            ns_to_cycles(clock_mhz, mode->min_low)) &&
+           (high_cycles(fields, rise_time) >=
+            ns_to_cycles(clock_mhz, mode->min_high));
+}
+
+/*
+ * RM0091 "Examples of timing settings for fI2CCLK = 48 MHz". The register
+ * values are the fields as written, one less than the counts they give.
+ */
+struct reference_timing
+{
+    uint32_t frequency;
+    struct timing_fields fields;
+};
+
+static const struct reference_timing reference_timings[] = {
+    {10000, {0xb, 0x4, 0x2, 0xc3, 0xc7}},
+    {100000, {0xb, 0x4, 0x2, 0x0f, 0x13}},
+    {400000, {0x5, 0x3, 0x3, 0x03, 0x09}},
+    {1000000, {0x5, 0x1, 0x0, 0x01, 0x03}}
+};
+
+#define REFERENCE_COUNT \
+    (sizeof(reference_timings) / sizeof(reference_timings[0]))
+
+static void test_reference_timings(void)
+{
+    for (size_t index = 0; index < REFERENCE_COUNT; index++) {
+        const struct reference_timing *reference = &reference_timings[index];
+        const struct bus_mode *mode = find_mode(reference->frequency);
+
+        // The model of the SCL phases accepts the manual's own settings
+        CHECK(meets_mode(&reference->fields, mode,
+                         DEFAULT_RISE_TIME, DEFAULT_FALL_TIME));
+
+        uint32_t timing;
+        uint32_t achieved;
+
+        CHECK(timing_compute(HOST_CLOCK, reference->frequency,
+                             DEFAULT_RISE_TIME, DEFAULT_FALL_TIME,
+                             &timing, &achieved));
+
+        struct timing_fields fields = split_timing(timing);
+
+        // Close to the frequency asked for, but never faster
+        uint32_t period = low_cycles(&fields, DEFAULT_FALL_TIME) +
+                          high_cycles(&fields, DEFAULT_RISE_TIME);
+
+        CHECK(achieved == HOST_CLOCK / period);
+        CHECK(achieved <= reference->frequency);
+        CHECK(achieved >= reference->frequency / 100 * 97);
+        CHECK(meets_mode(&fields, mode, DEFAULT_RISE_TIME, DEFAULT_FALL_TIME));
+
+        // Data set up after the rise and held past the fall
+        CHECK((fields.scldel + 1) * (fields.presc + 1) >=
+              ns_to_cycles(HOST_CLOCK / 1000000,
+                           DEFAULT_RISE_TIME + mode->min_setup));
+        CHECK(fields.sdadel * (fields.presc + 1) >=
+              ns_to_cycles(HOST_CLOCK / 1000000, DEFAULT_FALL_TIME));
+    }
+}
+
+static void test_all_frequencies(void)
+{
+    static const uint16_t edge_times[][2] = {
+        {DEFAULT_RISE_TIME, DEFAULT_FALL_TIME},
+        {300, 120},
+        {1000, 300}
+    };
+
+    for (size_t edges = 0; edges < 3; edges++) {
+        uint32_t rise_time = edge_times[edges][0];
+        uint32_t fall_time = edge_times[edges][1];
+
+        for (uint32_t frequency = 10000;
+             frequency <= 1000000;
+             frequency += 1000) {
+            uint32_t timing;
+            uint32_t achieved;
+
+            if (!timing_compute(HOST_CLOCK, frequency, rise_time, fall_time,
+                                &timing, &achieved)) {
+                // Only slow edges may rule out the fastest rates
+                CHECK((edges != 0) && (frequency > 400000));
+                continue;
+            }
+
+            struct timing_fields fields = split_timing(timing);
+
+            CHECK(achieved <= frequency);
+            CHECK(meets_mode(&fields, find_mode(frequency),
+                             rise_time, fall_time));
+
+            // The default edges leave room for the frequency asked for
+            if (edges == 0) {
+                CHECK(achieved >= frequency / 100 * 97);
+            }
+        }
+    }
+}
+
+static void test_limits(void)
+{
+    uint32_t timing;
+    uint32_t achieved;
+
+    CHECK(!timing_compute(HOST_CLOCK, 0, DEFAULT_RISE_TIME,
+                          DEFAULT_FALL_TIME, &timing, &achieved));
+    CHECK(!timing_compute(HOST_CLOCK, 1000001, DEFAULT_RISE_TIME,
+                          DEFAULT_FALL_TIME, &timing, &achieved));
+    CHECK(!timing_compute(HOST_CLOCK, 5000, DEFAULT_RISE_TIME,
+                          DEFAULT_FALL_TIME, &timing, &achieved));
+    CHECK(timing_compute(HOST_CLOCK, 7000, DEFAULT_RISE_TIME,
+                         DEFAULT_FALL_TIME, &timing, &achieved));
+}
+
+int main(void)
+{
+    test_reference_timings();
+    test_all_frequencies();
+    test_limits();
+
+    if (failures != 0) {
+        printf("%u checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,359 @@
+#include "simulation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/usb/usbd.h>
+
+/*
+ * The device side of one bulk OUT and one bulk IN endpoint on a full-speed
+ * link with the host always polling. A transaction takes the time of its
+ * data and about 16 bytes of token, handshake and CRC at 12 Mbit/s, one at
+ * a time, an IN packet before an OUT one. Frames and the control endpoint
+ * are left out, a bus reset stands for the whole enumeration.
+ */
+
+#define MAX_PACKET_SIZE 64
+#define MAX_OUTPUT_LENGTH 0x20000
+
+#define OUT_ENDPOINT 0x01
+#define IN_ENDPOINT 0x82
+
+#define TRANSACTION_OVERHEAD 16
+#define NANOSECONDS_PER_BYTE_NUMERATOR 2000
+#define NANOSECONDS_PER_BYTE_DENOMINATOR 3
+
+struct _usbd_driver
+{
+    int unused;
+};
+
+const usbd_driver st_usbfs_v2_usb_driver;
+
+struct _usbd_device
+{
+    usbd_set_config_callback set_config;
+    usbd_endpoint_callback out_callback;
+    usbd_endpoint_callback in_callback;
+};
+
+static usbd_device device;
+
+static uint32_t cntr;
+static uint32_t istr;
+
+static struct
+{
+    // Whether the firmware keeps the endpoint NAKing and whether it
+    // takes a packet
+    bool force_nak;
+    bool valid;
+
+    bool complete;
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint16_t length;
+} out;
+
+static struct
+{
+    bool busy;
+    bool complete;
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint16_t length;
+} in;
+
+// The transaction on the link and when it ends
+static enum
+{
+    LINK_IDLE,
+    LINK_OUT,
+    LINK_IN
+} link;
+static uint64_t link_end;
+
+static const uint8_t *input;
+static size_t input_length;
+static size_t input_packet_length;
+
+static uint8_t output[MAX_OUTPUT_LENGTH];
+static size_t output_length;
+
+static void usbd_fail(const char *message)
+{
+    fprintf(stderr, "usbd: %s\n", message);
+    abort();
+}
+
+static uint64_t transaction_time(size_t length)
+{
+    return (length + TRANSACTION_OVERHEAD) * NANOSECONDS_PER_BYTE_NUMERATOR /
+           NANOSECONDS_PER_BYTE_DENOMINATOR;
+}
+
+void usb_model_reset(void)
+{
+    memset(&device, 0, sizeof(device));
+    memset(&out, 0, sizeof(out));
+    memset(&in, 0, sizeof(in));
+
+    cntr = 0;
+    istr = 0;
+    link = LINK_IDLE;
+
+    input_length = 0;
+    output_length = 0;
+}
+
+volatile uint32_t *usb_model_register(uint32_t offset)
+{
+    switch (offset) {
+    case 0x40:
+        return &cntr;
+    case 0x44:
+        return &istr;
+    default:
+        usbd_fail("access to an unknown USB register");
+        return NULL;
+    }
+}
+
+void usb_model_send(const uint8_t *data, size_t length, size_t packet_length)
+{
+    input = data;
+    input_length = length;
+    input_packet_length = (packet_length < MAX_PACKET_SIZE) ?
+                          packet_length : MAX_PACKET_SIZE;
+}
+
+const uint8_t *usb_model_output(size_t *length)
+{
+    *length = output_length;
+    output[output_length] = '\0';
+
+    return output;
+}
+
+void usb_model_clear_output(void)
+{
+    output_length = 0;
+}
+
+uint64_t usb_model_next_event(void)
+{
+    if (link != LINK_IDLE) {
+        return link_end;
+    }
+
+    if (in.busy || (out.valid && (input_length > 0))) {
+        return simulation_time;
+    }
+
+    return SIMULATION_NEVER;
+}
+
+static void link_finish(void)
+{
+    if (link == LINK_IN) {
+        size_t length = in.length;
+
+        if (length > MAX_OUTPUT_LENGTH - 1 - output_length) {
+            length = MAX_OUTPUT_LENGTH - 1 - output_length;
+        }
+
+        memcpy(&output[output_length], in.packet, length);
+        output_length += length;
+
+        in.busy = false;
+        in.complete = true;
+    } else {
+        // The endpoint NAKs until the firmware has read the packet
+        out.valid = false;
+        out.complete = true;
+    }
+
+    istr |= USB_ISTR_CTR;
+    link = LINK_IDLE;
+}
+
+static void link_start(void)
+{
+    if (in.busy) {
+        link = LINK_IN;
+        link_end = simulation_time + transaction_time(in.length);
+        return;
+    }
+
+    size_t length = (input_length < input_packet_length) ?
+                    input_length : input_packet_length;
+
+    memcpy(out.packet, input, length);
+    out.length = (uint16_t)length;
+
+    input += length;
+    input_length -= length;
+
+    link = LINK_OUT;
+    link_end = simulation_time + transaction_time(length);
+}
+
+void usb_model_run(void)
+{
+    while (usb_model_next_event() <= simulation_time) {
+        if (link != LINK_IDLE) {
+            link_finish();
+        } else {
+            link_start();
+        }
+    }
+}
+
+bool usb_model_irq(void)
+{
+    return (istr & cntr) != 0;
+}
+
+usbd_device *usbd_init(const usbd_driver *driver,
+                       const struct usb_device_descriptor *dev,
+                       const struct usb_config_descriptor *conf,
+                       const char * const *strings, int num_strings,
+                       uint8_t *control_buffer,
+                       uint16_t control_buffer_size)
+{
+    (void)driver;
+    (void)dev;
+    (void)conf;
+    (void)strings;
+    (void)num_strings;
+    (void)control_buffer;
+    (void)control_buffer_size;
+
+    // The host resets the bus and configures the device right away
+    istr |= USB_ISTR_RESET;
+
+    return &device;
+}
+
+int usbd_register_set_config_callback(usbd_device *usbd_dev,
+                                      usbd_set_config_callback callback)
+{
+    usbd_dev->set_config = callback;
+
+    return 0;
+}
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+                                   uint8_t type_mask,
+                                   usbd_control_callback callback)
+{
+    (void)usbd_dev;
+    (void)type;
+    (void)type_mask;
+    (void)callback;
+
+    return 0;
+}
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t address, uint8_t type,
+                   uint16_t max_size, usbd_endpoint_callback callback)
+{
+    (void)type;
+    (void)max_size;
+
+    if (address == OUT_ENDPOINT) {
+        usbd_dev->out_callback = callback;
+        out.force_nak = false;
+        out.valid = true;
+    } else if (address == IN_ENDPOINT) {
+        usbd_dev->in_callback = callback;
+    }
+}
+
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t address,
+                              const void *buffer, uint16_t length)
+{
+    (void)usbd_dev;
+
+    if ((address != IN_ENDPOINT) || in.busy) {
+        return 0;
+    }
+
+    if (length > MAX_PACKET_SIZE) {
+        usbd_fail("packet longer than the endpoint takes");
+    }
+
+    memcpy(in.packet, buffer, length);
+    in.length = length;
+    in.busy = true;
+
+    return length;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t address,
+                             void *buffer, uint16_t length)
+{
+    (void)usbd_dev;
+
+    if ((address != OUT_ENDPOINT) || !out.complete) {
+        return 0;
+    }
+
+    if (length > out.length) {
+        length = out.length;
+    }
+
+    memcpy(buffer, out.packet, length);
+    out.complete = false;
+
+    if (!out.force_nak) {
+        out.valid = true;
+    }
+
+    return length;
+}
+
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t address, uint8_t nak)
+{
+    (void)usbd_dev;
+
+    if (address != OUT_ENDPOINT) {
+        return;
+    }
+
+    out.force_nak = (nak != 0);
+    out.valid = !out.force_nak && !out.complete;
+}
+
+void usbd_poll(usbd_device *usbd_dev)
+{
+    if ((istr & USB_ISTR_RESET) != 0) {
+        istr &= ~USB_ISTR_RESET;
+
+        if (usbd_dev->set_config) {
+            usbd_dev->set_config(usbd_dev, 1);
+        }
+
+        return;
+    }
+
+    if ((istr & USB_ISTR_CTR) == 0) {
+        istr &= ~(USB_ISTR_SOF | USB_ISTR_SUSP | USB_ISTR_WKUP);
+        return;
+    }
+
+    if (in.complete) {
+        in.complete = false;
+
+        if (usbd_dev->in_callback) {
+            usbd_dev->in_callback(usbd_dev, IN_ENDPOINT);
+        }
+    } else if (out.complete && usbd_dev->out_callback) {
+        usbd_dev->out_callback(usbd_dev, OUT_ENDPOINT);
+    }
+
+    // A packet left unread keeps the flag up, as on the device
+    if (!in.complete && !out.complete) {
+        istr &= ~USB_ISTR_CTR;
+    }
+}